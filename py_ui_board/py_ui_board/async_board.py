@@ -0,0 +1,229 @@
+from .ui_board import UiBoard
+from collections import deque
+from concurrent.futures import Future
+from contextlib import contextmanager
+from PIL import Image
+import threading
+import usb.core
+
+
+def _queued(method, frame=False, wait=False):
+    """wrap a UiBoard method so that it runs in the I/O thread.
+    frame: it replaces the whole display content and may be dropped in favour of a newer one.
+    wait: block until it's done and return its result (for the queries), else return a Future.
+    """
+
+    def f(self, *args, **kwargs):
+        fut = self._submit(method, args, kwargs, frame)
+        return fut.result() if wait else fut
+
+    f.__name__ = method.__name__
+    f.__doc__ = method.__doc__
+    return f
+
+
+class AsyncUiBoard(UiBoard):
+    """UiBoard doing the USB transfers in background threads, so the GUI main-loop doesn't wait for the bus.
+
+    Commands and display updates are queued and sent in order by a writer thread. When the device falls
+    behind, the oldest pending full frame (send_img(), send_fb()) is dropped, at most max_frames of them
+    are waiting. Other commands are never dropped, submitting them blocks once max_pending are waiting.
+    They return a Future, the queries (get_*) wait for their result.
+
+    A reader thread receives the reports of the interrupt endpoint. get_inputs() merges all of them which
+    arrived since the last call without touching the bus, read_report(), read_inputs() and wait_frame()
+    take them one by one. Use only one of these ways. Or pass on_report, a function called with each Report
+    from the reader thread, which then keeps none of them.
+
+    Call close() (or use it as context manager) to stop the threads.
+    """
+
+    def __init__(self, dev: usb.core.Device, max_frames=2, max_pending=64, max_reports=256, on_report=None):
+        super().__init__(dev)
+        self.max_frames = max_frames
+        self.max_pending = max_pending
+        self.frames_dropped = 0  # full frames dropped because a newer one was submitted
+        self.reports_lost = 0  # reports dropped because nobody took them
+        self.error = None  # last exception of the I/O threads
+        self.on_report = on_report
+        self._q = deque()  # (future, method, args, kwargs, frame)
+        self._n_frames = 0  # pending full frames in _q
+        self._busy = False  # the writer is executing an item
+        self._reports = deque(maxlen=max_reports)
+        self._btn_state = 0  # last BTN0_STATE / BTN1_STATE
+        self._cv = threading.Condition()
+        self._running = True
+        self._threads = [
+            threading.Thread(target=self._writer, name="ui_board_tx", daemon=True),
+            threading.Thread(target=self._reader, name="ui_board_rx", daemon=True),
+        ]
+        for th in self._threads:
+            th.start()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def close(self):
+        """send what's queued, then stop the I/O threads"""
+        with self._cv:
+            self._running = False
+            self._cv.notify_all()
+        for th in self._threads:
+            th.join()
+
+    def sync(self, timeout=None):
+        """wait until all queued commands have been sent. Returns False on timeout."""
+        with self._cv:
+            return self._cv.wait_for(lambda: not self._q and not self._busy, timeout)
+
+    def _submit(self, method, args, kwargs, frame):
+        fut = Future()
+        if threading.current_thread() is self._threads[0]:
+            # a UiBoard method running in the writer calls another one, e.g. send_img() -> send_fb()
+            fut.set_result(method(self, *args, **kwargs))
+            return fut
+        with self._cv:
+            if not self._running:
+                raise RuntimeError("AsyncUiBoard is closed.")
+            if self.error is not None:
+                err, self.error = self.error, None
+                raise err
+            if frame and self._n_frames >= self.max_frames:
+                # drop-oldest: the newer frame covers the whole display anyway
+                old = next(it for it in self._q if it[4])
+                self._q.remove(old)
+                old[0].cancel()
+                self._n_frames -= 1
+                self.frames_dropped += 1
+            elif not frame:
+                self._cv.wait_for(lambda: len(self._q) - self._n_frames < self.max_pending)
+            self._q.append((fut, method, args, kwargs, frame))
+            self._n_frames += frame
+            self._cv.notify_all()
+        return fut
+
+    def _writer(self):
+        while True:
+            with self._cv:
+                self._busy = False
+                self._cv.notify_all()
+                self._cv.wait_for(lambda: self._q or not self._running)
+                if not self._q:
+                    return
+                fut, method, args, kwargs, frame = self._q.popleft()
+                self._n_frames -= frame
+                self._busy = True
+                self._cv.notify_all()
+            if not fut.set_running_or_notify_cancel():
+                continue
+            try:
+                fut.set_result(method(self, *args, **kwargs))
+            except Exception as e:
+                fut.set_exception(e)
+                if frame:
+                    # nobody looks at the Future of a frame which may get dropped
+                    self.error = e
+
+    def _reader(self):
+        while self._running:
+            try:
+                rep = UiBoard.read_report(self, timeout=50)
+            except usb.core.USBError as e:
+                self.error = e
+                return
+            if rep is None:
+                continue
+            if self.on_report is not None:
+                self.on_report(rep)
+                continue
+            with self._cv:
+                if len(self._reports) == self._reports.maxlen:
+                    self.reports_lost += 1
+                self._reports.append(rep)
+                self._cv.notify_all()
+
+    def send_img(self, img: Image.Image):
+        # the caller may draw the next frame into the same image
+        return self._submit(UiBoard.send_img, (img.copy(),), {}, True)
+
+    def send_fb(self, buf: bytes):
+        return self._submit(UiBoard.send_fb, (bytes(buf),), {}, True)
+
+    @contextmanager
+    def batch(self):
+        # the writer thread collects the commands between these two
+        self._submit(UiBoard._batch_begin, (), {}, False)
+        try:
+            yield self
+        except BaseException:
+            self._submit(UiBoard._batch_abort, (), {}, False)
+            raise
+        self._submit(UiBoard._batch_end, (), {}, False)
+
+    batch.__doc__ = UiBoard.batch.__doc__
+
+    send_batch = _queued(UiBoard.send_batch)
+    send_window = _queued(UiBoard.send_window)
+    send_draw = _queued(UiBoard.send_draw)
+    send_font = _queued(UiBoard.send_font)
+    scroll_rows = _queued(UiBoard.scroll_rows)
+    set_start_line = _queued(UiBoard.set_start_line)
+    reset = _queued(UiBoard.reset)
+    flush = _queued(UiBoard.flush)
+    set_fb_mode = _queued(UiBoard.set_fb_mode)
+    set_fb_rate = _queued(UiBoard.set_fb_rate)
+    set_vsync = _queued(UiBoard.set_vsync)
+    set_led = _queued(UiBoard.set_led)
+    set_inverted = _queued(UiBoard.set_inverted)
+    set_brightness = _queued(UiBoard.set_brightness)
+    set_depth = _queued(UiBoard.set_depth)
+    set_gamma = _queued(UiBoard.set_gamma)
+    set_encoder_accel = _queued(UiBoard.set_encoder_accel)
+    set_spi_clock = _queued(UiBoard.set_spi_clock, wait=True)
+    get_fw_version = _queued(UiBoard.get_fw_version, wait=True)
+    get_stats = _queued(UiBoard.get_stats, wait=True)
+    get_events = _queued(UiBoard.get_events, wait=True)
+
+    def get_inputs(self, accel=False):
+        """like UiBoard.get_inputs(), but from the reports received in the background"""
+        with self._cv:
+            reps = list(self._reports)
+            self._reports.clear()
+        flags, delta, acc = self._btn_state, 0, 0
+        for rep in reps:
+            flags = (flags & ~3) | rep.button_flags
+            delta += rep.encoder_delta
+            acc += rep.encoder_accel
+        self._btn_state = flags & 3
+        if accel:
+            return flags, delta, acc
+        return flags, delta
+
+    def read_report(self, timeout=100):
+        with self._cv:
+            if not self._cv.wait_for(lambda: self._reports, timeout / 1000):
+                return None
+            return self._reports.popleft()
+
+    read_report.__doc__ = UiBoard.read_report.__doc__
+
+    def read_inputs(self, timeout=100, accel=False):
+        rep = self.read_report(timeout)
+        if rep is None:
+            return None
+        if accel:
+            return rep.button_flags, rep.encoder_delta, rep.encoder_accel
+        return rep.button_flags, rep.encoder_delta
+
+    read_inputs.__doc__ = UiBoard.read_inputs.__doc__
+
+    def wait_frame(self, timeout=100):
+        # the sequence number of the last frame is only known once it has been sent
+        if not self.sync(timeout / 1000):
+            return None
+        return super().wait_frame(timeout)
+
+    wait_frame.__doc__ = UiBoard.wait_frame.__doc__
@@ -0,0 +1,275 @@
+"""Measure frame rate, latency and bus utilisation of a ui_to_usb board.
+
+    python -m py_ui_board.benchmark [-t SECONDS] [-o results.json] [--compare old.json]
+
+Runs each scenario on the first board found and prints the results as JSON, tagged with the firmware version
+(CMD_VERSION). With --compare, the main figures of an earlier result file are compared and the command
+fails if one of them got worse by more than --tolerance.
+"""
+
+from .ui_board import FB_MODE, VSYNC, W, H, UiBoard, find_ui_board_devices, packbits
+import argparse
+import datetime
+import json
+import numpy as np
+import platform
+import sys
+import threading
+import time
+
+
+def _dist(samples):
+    """summary of a list of durations [s], in [ms]"""
+    if len(samples) == 0:
+        return None
+    a = np.array(samples) * 1e3
+    return {
+        "n": int(a.size),
+        "min_ms": float(a.min()),
+        "avg_ms": float(a.mean()),
+        "p50_ms": float(np.percentile(a, 50)),
+        "p99_ms": float(np.percentile(a, 99)),
+        "max_ms": float(a.max()),
+        "std_ms": float(a.std()),
+    }
+
+
+def _drain(ui: UiBoard):
+    """drop reports left over from earlier scenarios"""
+    while ui.read_report(timeout=5) is not None:
+        pass
+
+
+def _noise_frame(rng):
+    """incompressible full frame"""
+    return rng.integers(0, 256, W * H // 2, dtype=np.uint8).tobytes()
+
+
+def _bars_frame(i):
+    """full frame which compresses well: vertical bars, moving by one byte per frame"""
+    row = bytes((((x + i) // 8) & 0xF) * 0x11 for x in range(W // 2))
+    return row * H
+
+
+# FB_MODE.RAW finds the start of a frame by the bus being quiet for 4 ms before it, frames sent closer together
+# get dropped, which would count as throughput on the host side only
+RAW_GAP_S = 0.005
+
+
+def _blast(ui: UiBoard, duration, send, gap=0):
+    """call send(i) for duration [s], waiting gap [s] after each one. Returns updates sent / s"""
+    n = 0
+    t0 = time.perf_counter()
+    while time.perf_counter() - t0 < duration:
+        send(n)
+        n += 1
+        if gap:
+            time.sleep(gap)
+    return n / (time.perf_counter() - t0)
+
+
+def _acked(ui: UiBoard, duration, send, gap=0):
+    """send(i) one update at a time and wait until the device signals it completed, then gap [s].
+    Returns the frame-to-ack latencies and the intervals between the frame completion reports.
+    """
+    ui.set_vsync(VSYNC.REPORT)
+    _drain(ui)
+    latencies = []
+    t_done = []
+    n = 0
+    t0 = time.perf_counter()
+    while time.perf_counter() - t0 < duration:
+        ts = time.perf_counter()
+        send(n)
+        rep = ui.wait_frame(timeout=200)
+        if rep is None:
+            break
+        latencies.append(time.perf_counter() - ts)
+        t_done.append(rep.frame_t_us)
+        n += 1
+        if gap:
+            time.sleep(gap)
+    ui.set_vsync(0)
+    # firmware timestamps give the jitter without the host side USB scheduling
+    intervals = np.diff(np.array(t_done, dtype=np.uint32)) / 1e6  # wraps around correctly as uint32
+    return latencies, intervals.tolist()
+
+
+def _scenario(ui: UiBoard, mode: FB_MODE, duration, bytes_per_update, send):
+    ui.set_fb_mode(mode)
+    gap = RAW_GAP_S if mode == FB_MODE.RAW else 0
+    ui.get_stats(reset=True)
+    rate = _blast(ui, duration / 2, send, gap)
+    stats = ui.get_stats(reset=True)
+    latencies, intervals = _acked(ui, duration / 2, send, gap)
+    return {
+        "mode": mode.name,
+        # what the firmware completed, updates it dropped or merged don't count
+        "frames_per_s": stats["frames_per_s"],
+        "sent_per_s": rate,
+        "host_mbit_per_s": rate * bytes_per_update * 8 / 1e6,
+        # what the firmware actually read from the bulk endpoint, the full speed ceiling is ~8 Mbit/s
+        "wire_mbit_per_s": stats["rx_bytes_per_s"] * 8 / 1e6,
+        "ack_latency": _dist(latencies),
+        "done_interval": _dist(intervals),
+        "firmware": stats,
+    }
+
+
+def bench_full_frame(ui: UiBoard, duration):
+    """uncompressed full frames in FB_MODE.RAW"""
+    rng = np.random.default_rng(0)
+    frames = [_noise_frame(rng) for _ in range(8)]
+    return _scenario(ui, FB_MODE.RAW, duration, len(frames[0]), lambda i: ui.send_fb(frames[i % len(frames)]))
+
+
+def bench_dirty_rect(ui: UiBoard, duration):
+    """a 32 x 16 pixel window moving over the display, in FB_MODE.PACKET"""
+    rng = np.random.default_rng(1)
+    win = rng.integers(0, 256, 16 * 32 // 2, dtype=np.uint8).tobytes()
+
+    def send(i):
+        x = (i * 4) % (W - 32)
+        y = i % (H - 16)
+        ui.send_window(x, y, x + 31, y + 15, win)
+
+    return _scenario(ui, FB_MODE.PACKET, duration, len(win), send)
+
+
+def bench_compressed(ui: UiBoard, duration):
+    """full frames which compress well with PackBits, in FB_MODE.PACKET"""
+    frames = [_bars_frame(i) for i in range(16)]
+    ret = _scenario(ui, FB_MODE.PACKET, duration, len(frames[0]), lambda i: ui.send_fb(frames[i % len(frames)]))
+    # host_mbit_per_s is the uncompressed equivalent, the firmware counts what actually went over the bus
+    ret["wire_bytes_per_update"] = 6 + 4 + len(packbits(frames[0]))  # header, window, pixels
+    return ret
+
+
+def bench_input_poll(ui: UiBoard, duration):
+    """round trip time and jitter of polling the inputs, while full frames are sent in the background"""
+    ui.set_fb_mode(FB_MODE.PACKET)
+    rng = np.random.default_rng(2)
+    frame = _noise_frame(rng)
+    stop = threading.Event()
+    n_frames = 0
+
+    def blast():
+        nonlocal n_frames
+        while not stop.is_set():
+            ui.send_fb(frame)
+            n_frames += 1
+
+    ui.get_stats(reset=True)
+    th = threading.Thread(target=blast)
+    th.start()
+    rtt = []
+    t_poll = []
+    t0 = time.perf_counter()
+    try:
+        while time.perf_counter() - t0 < duration:
+            ts = time.perf_counter()
+            ui.get_inputs()
+            rtt.append(time.perf_counter() - ts)
+            t_poll.append(ts)
+    finally:
+        stop.set()
+        th.join()
+    t = time.perf_counter() - t0
+    stats = ui.get_stats(reset=True)
+    return {
+        "mode": FB_MODE.PACKET.name,
+        "frames_per_s": stats["frames_per_s"],
+        "sent_per_s": n_frames / t,
+        "poll_rtt": _dist(rtt),
+        "poll_interval": _dist(np.diff(t_poll).tolist()),
+        "firmware": stats,
+    }
+
+
+SCENARIOS = {
+    "full_frame": bench_full_frame,
+    "dirty_rect": bench_dirty_rect,
+    "compressed": bench_compressed,
+    "input_poll": bench_input_poll,
+}
+
+
+def run(ui: UiBoard, duration=4.0, scenarios=None):
+    """run the scenarios (all if None), duration [s] each. Returns the results as dict."""
+    ret = {
+        "fw_version": ui.get_fw_version().rstrip("\0"),
+        "host": platform.platform(),
+        "date": datetime.datetime.now().isoformat(timespec="seconds"),
+        "duration_s": duration,
+        "scenarios": {},
+    }
+    for name in scenarios or SCENARIOS:
+        ret["scenarios"][name] = SCENARIOS[name](ui, duration)
+    ui.set_fb_mode(FB_MODE.RAW)
+    return ret
+
+
+# Figures checked by compare(): path in a scenario, True if bigger is better
+KEY_FIGURES = (
+    (("frames_per_s",), True),
+    (("wire_mbit_per_s",), True),
+    (("ack_latency", "p50_ms"), False),
+    (("ack_latency", "p99_ms"), False),
+    (("poll_rtt", "p50_ms"), False),
+    (("poll_rtt", "p99_ms"), False),
+)
+
+
+def compare(old, new, tolerance=0.1):
+    """compare the KEY_FIGURES of two results. Returns a list of (scenario, figure, old, new, regressed)"""
+    ret = []
+    for name, res in new["scenarios"].items():
+        if name not in old["scenarios"]:
+            continue
+        for path, bigger_better in KEY_FIGURES:
+            a, b = old["scenarios"][name], res
+            for k in path:
+                a = a.get(k) if a else None
+                b = b.get(k) if b else None
+            if a is None or b is None:
+                continue
+            worse = b < a * (1 - tolerance) if bigger_better else b > a * (1 + tolerance)
+            ret.append((name, ".".join(path), a, b, worse))
+    return ret
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("-t", "--duration", type=float, default=4.0, help="seconds per scenario")
+    parser.add_argument("-s", "--scenario", action="append", choices=SCENARIOS, help="run only these")
+    parser.add_argument("-o", "--output", help="write the results to this file instead of stdout")
+    parser.add_argument("--compare", help="earlier results to check for regressions")
+    parser.add_argument("--tolerance", type=float, default=0.1, help="allowed relative change for --compare")
+    args = parser.parse_args()
+
+    devs = find_ui_board_devices()
+    if not devs:
+        sys.exit("no ui_to_usb board found")
+    ui = UiBoard(devs[0])
+    res = run(ui, args.duration, args.scenario)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(res, f, indent=2)
+    else:
+        json.dump(res, sys.stdout, indent=2)
+        print()
+
+    if args.compare:
+        with open(args.compare) as f:
+            old = json.load(f)
+        print(f"{old['fw_version']} -> {res['fw_version']}", file=sys.stderr)
+        failed = False
+        for name, fig, a, b, worse in compare(old, res, args.tolerance):
+            print(f"{name:12s} {fig:16s} {a:10.3f} -> {b:10.3f}{'  REGRESSION' if worse else ''}", file=sys.stderr)
+            failed |= worse
+        sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,126 @@
+from .async_board import AsyncUiBoard
+from .ui_board import UiBoard, find_ui_board_devices
+from collections import deque
+import threading
+import time
+import usb.util
+
+
+def get_serial(dev):
+    """serial number string of a ui_to_usb device: R1S<unique ID of the chip in hex>"""
+    return usb.util.get_string(dev, dev.iSerialNumber)
+
+
+class UiBoardGroup:
+    """drives several boards at once, keyed by their serial number (see get_serial()).
+
+    Each board is an AsyncUiBoard with its own I/O threads, so frames and commands submitted to all of them
+    go out concurrently and the update takes as long as the slowest board, not the sum of all.
+    The input reports of all boards are merged into one queue, in the order they arrived, oldest ones are
+    dropped when more than max_reports are waiting. The boards' own get_inputs() / read_report() don't see
+    them, use the ones of the group.
+
+    Close it (or use it as context manager) to stop the I/O threads.
+    """
+
+    def __init__(self, devices=None, max_reports=1024, **kwargs):
+        """devices: list of usb.core.Device, all ui_to_usb boards found if None.
+        kwargs are passed on to AsyncUiBoard.
+        """
+        if devices is None:
+            devices = find_ui_board_devices()
+        self.reports_lost = 0  # reports dropped because nobody took them
+        self._reports = deque(maxlen=max_reports)  # (serial, Report)
+        self._btn_state = {}  # last BTN0_STATE / BTN1_STATE of each board
+        self._cv = threading.Condition()
+        self.boards = {}
+        try:
+            for dev in devices:
+                serial = get_serial(dev)
+                self.boards[serial] = AsyncUiBoard(dev, on_report=self._receiver(serial), **kwargs)
+                self._btn_state[serial] = 0
+        except Exception:
+            self.close()
+            raise
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __getitem__(self, serial) -> AsyncUiBoard:
+        return self.boards[serial]
+
+    def __iter__(self):
+        return iter(self.boards)
+
+    def __len__(self):
+        return len(self.boards)
+
+    def close(self):
+        for b in self.boards.values():
+            b.close()
+
+    def _receiver(self, serial):
+        def put(rep):
+            with self._cv:
+                if len(self._reports) == self._reports.maxlen:
+                    self.reports_lost += 1
+                self._reports.append((serial, rep))
+                self._cv.notify_all()
+
+        return put
+
+    def call(self, name, *args, **kwargs):
+        """call UiBoard method name with the same arguments on all boards, concurrently.
+        Waits until all are done and returns {serial: result}.
+        """
+        method = getattr(UiBoard, name)
+        futs = {s: b._submit(method, args, kwargs, False) for s, b in self.boards.items()}
+        return {s: f.result() for s, f in futs.items()}
+
+    def send_img(self, imgs):
+        """imgs: {serial: PIL Image}, only these boards get a new frame. Returns without waiting,
+        frames older than the boards' max_frames get dropped (see AsyncUiBoard).
+        """
+        for serial, img in imgs.items():
+            self.boards[serial].send_img(img)
+
+    def send_fb(self, bufs):
+        """bufs: {serial: packed framebuffer}, like send_img()"""
+        for serial, buf in bufs.items():
+            self.boards[serial].send_fb(buf)
+
+    def sync(self, timeout=None):
+        """wait until all boards sent everything queued. Returns False on timeout."""
+        # the boards work in parallel, so waiting for one after the other costs no extra time
+        deadline = None if timeout is None else time.monotonic() + timeout
+        for b in self.boards.values():
+            if not b.sync(None if deadline is None else max(deadline - time.monotonic(), 0)):
+                return False
+        return True
+
+    def get_inputs(self, accel=False):
+        """{serial: (button_flags, encoder_delta (, encoder_accel))} like UiBoard.get_inputs() for all boards,
+        merged from the reports received since the last call
+        """
+        with self._cv:
+            reps = list(self._reports)
+            self._reports.clear()
+        flags = {s: (f, 0, 0) for s, f in self._btn_state.items()}
+        for serial, rep in reps:
+            f, delta, acc = flags[serial]
+            flags[serial] = ((f & ~3) | rep.button_flags, delta + rep.encoder_delta, acc + rep.encoder_accel)
+        for serial, (f, _, _) in flags.items():
+            self._btn_state[serial] = f & 3
+        if accel:
+            return flags
+        return {s: v[:2] for s, v in flags.items()}
+
+    def read_report(self, timeout=100):
+        """wait for the next report of any board, returns (serial, Report) or None after timeout [ms]"""
+        with self._cv:
+            if not self._cv.wait_for(lambda: self._reports, timeout / 1000):
+                return None
+            return self._reports.popleft()
@@ -1,5 +1,8 @@
 from aggdraw import Brush, Pen, Draw
-from PIL import Image
+from enum import IntEnum
+from PIL import Image, ImageDraw, ImageFont
+import numpy as np
+import struct
 
 
 # ----------------------------------
@@ -17,8 +20,19 @@ def load_img(name, scale=1.0):
 
 
 class GuiPrimitives:
-    def __init__(self, img: Image.Image):
-        self.draw = Draw(img)
+    """Draws into img on the host. The same shapes can be drawn by the firmware with the operations collected
+    in device, a DrawList (needs FB_MODE.BUFFERED):
+
+        gp.device.fill_rect(0, 0, 31, 7, 4)
+        ui.send_draw(gp.device)
+        gp.device.clear()
+
+    img can be None if only the device is drawn on.
+    """
+
+    def __init__(self, img: Image.Image = None):
+        self.draw = Draw(img) if img is not None else None
+        self.device = DrawList()
         self.W = 256
         self.H = 64
 
@@ -47,3 +61,110 @@ class GuiPrimitives:
     def rectangle(self, x, y, w=30, h=15, r=0, **kwargs):
         """a rectangle centered at x and y with width w and height h and corner radius r"""
         self.draw.rounded_rectangle((x - w / 2, y - h / 2, x + w / 2, y + h / 2), r, *self._bh(**kwargs))
+
+
+# ----------------------------------
+#  Drawing on the device
+# ----------------------------------
+# Drawing operations executed by the firmware, see fb_draw() in framebuffer.h
+class DRAW(IntEnum):
+    PIXEL = 0x01
+    FILL = 0x02
+    HLINE = 0x03
+    VLINE = 0x04
+    BLIT = 0x05
+    SCROLL = 0x06
+    TEXT = 0x07
+
+
+class DrawList:
+    """Encodes drawing operations, which the firmware executes on its framebuffer (needs FB_MODE.BUFFERED).
+    A few bytes per operation instead of the pixels. Send it with UiBoard.send_draw().
+    Coordinates are in pixels and inclusive, shades are 0 - 15.
+    """
+
+    # max. payload of one message, the firmware skips bigger ones
+    MAX_LEN = 512
+
+    def __init__(self):
+        self.ops = []
+
+    def clear(self):
+        self.ops = []
+
+    def pixel(self, x, y, shade=15):
+        self.ops.append(struct.pack("BBBB", DRAW.PIXEL, x, y, shade))
+
+    def fill_rect(self, x1, y1, x2, y2, shade=15):
+        self.ops.append(struct.pack("BBBBBB", DRAW.FILL, x1, y1, x2, y2, shade))
+
+    def hline(self, x1, x2, y, shade=15):
+        self.ops.append(struct.pack("BBBBB", DRAW.HLINE, x1, x2, y, shade))
+
+    def vline(self, x, y1, y2, shade=15):
+        self.ops.append(struct.pack("BBBBB", DRAW.VLINE, x, y1, y2, shade))
+
+    def blit(self, x, y, bitmap, fg=15, bg=None):
+        """draw a 1 bpp bitmap (2D bool array or mode "1" PIL Image) with its top left corner at x, y.
+        Set pixels are drawn with fg, the others with bg. bg = None leaves them untouched.
+        """
+        bits = np.array(bitmap, dtype=bool)
+        h, w = bits.shape
+        rows = np.packbits(bits, axis=1)
+        # split big bitmaps into stripes which fit into a message
+        n = max(1, (self.MAX_LEN - 7) // rows.shape[1])
+        for i in range(0, h, n):
+            stripe = rows[i : i + n]
+            hdr = struct.pack("BBBBBBB", DRAW.BLIT, x, y + i, w, len(stripe), fg, 0xFF if bg is None else bg)
+            self.ops.append(hdr + stripe.tobytes())
+
+    def scroll(self, x1, y1, x2, y2, dx=0, dy=-1, shade=0):
+        """move the content of a rectangle by dx, dy pixels. Uncovered pixels are filled with shade."""
+        self.ops.append(struct.pack("BBBBBbbB", DRAW.SCROLL, x1, y1, x2, y2, dx, dy, shade))
+
+    def text(self, x, y, s, fg=15, bg=None):
+        """draw string s with its top left corner at x, y, using the glyphs uploaded with UiBoard.send_font().
+        Glyph pixels are drawn with fg, the background with bg. bg = None leaves it untouched.
+        Characters which are not in the font are skipped. Up to 255 characters.
+        """
+        chars = s.encode("latin-1", errors="replace")
+        self.ops.append(struct.pack("BBBBBB", DRAW.TEXT, x, y, fg, 0xFF if bg is None else bg, len(chars)) + chars)
+
+    def chunks(self):
+        """the encoded operations, grouped into payloads of up to MAX_LEN bytes"""
+        chunk = b""
+        for op in self.ops:
+            if len(chunk) + len(op) > self.MAX_LEN:
+                yield chunk
+                chunk = b""
+            chunk += op
+        if chunk:
+            yield chunk
+
+
+# max. size of the glyph cache on the device
+FONT_MEM_SIZE = 3072
+
+
+def make_font(font: ImageFont.FreeTypeFont, first=32, count=95):
+    """render the characters first .. first + count - 1 of a PIL font into a glyph cache upload
+    for UiBoard.send_font(). All glyphs get the full height of the font and their own width.
+    """
+    ascent, descent = font.getmetrics()
+    h = ascent + descent
+    widths = []
+    bitmaps = b""
+    for i in range(count):
+        ch = chr(first + i)
+        w = round(font.getlength(ch))
+        widths.append(w)
+        if w == 0:
+            continue
+        img = Image.new("1", (w, h))
+        ImageDraw.Draw(img).text((0, 0), ch, font=font, fill=1)
+        bitmaps += np.packbits(np.array(img, dtype=bool), axis=1).tobytes()
+
+    data = bytes([first, count, h] + widths) + bitmaps
+    if len(data) > FONT_MEM_SIZE:
+        raise ValueError(f"Font needs {len(data)} bytes, only {FONT_MEM_SIZE} fit into the glyph cache.")
+    return data
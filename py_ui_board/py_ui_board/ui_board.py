@@ -1,7 +1,11 @@
-from enum import IntEnum
+from collections import namedtuple
+from contextlib import contextmanager
+from enum import IntEnum, IntFlag
 from PIL import Image
+import errno
 import numpy as np
 import struct
+import time
 import usb.core
 import usb.util
 
@@ -37,13 +41,233 @@ class REQ(IntEnum):
 class CMD(IntEnum):
     RESET = 0x10
     VERSION = 0x11
+    STATS = 0x12
+    SPI_CLOCK = 0x13
+    BATCH = 0x14
     BTNS_ENC = 0x20
     IO_LEDS = 0x21
+    EVENTS = 0x22
+    ENC_ACCEL = 0x23
     # IO_AUX_OE = 0x28
     # IO_AUX_OL = 0x29
-    # OLED_FLUSH = 0x30
+    OLED_FLUSH = 0x30
     OLED_BRIGHTNESS = 0x31
     OLED_INVERTED = 0x32
+    OLED_MODE = 0x33
+    OLED_FB_RATE = 0x34
+    OLED_SCROLL = 0x35
+    OLED_VSYNC = 0x36
+    OLED_DEPTH = 0x37
+    OLED_GAMMA = 0x38
+
+
+# Bits of button_flags, as returned by get_inputs() and read_inputs()
+class BTN(IntFlag):
+    # instantaneous state
+    ENC = 1 << 0
+    BACK = 1 << 1
+    # press events since the last call / report
+    ENC_SHORT = 1 << 2
+    BACK_SHORT = 1 << 3
+    ENC_LONG = 1 << 4
+    BACK_LONG = 1 << 5
+
+
+# Input event types, see get_events()
+class EVT(IntEnum):
+    # encoder moved by delta steps
+    ENC = 1
+    # button state changed or press event, see flags
+    BTN = 2
+
+
+# t_us: timestamp in [us] (wraps around), type: EVT, flags: BTN state after the event plus the
+# press event if any, delta: encoder steps
+Event = namedtuple("Event", "t_us type flags delta")
+EVENT_FMT = "<IBBh"
+MAX_EVENTS = 32
+
+# Report on the interrupt endpoint. frame_done: a frame has been put on the display since the last report,
+# frame_seq: seq of the message which completed it (frame counter in FB_MODE.RAW), frame_t_us: when,
+# clock_reg: display clock register (0xB3), refresh_us: estimated refresh period of the panel
+Report = namedtuple(
+    "Report", "button_flags encoder_delta encoder_accel frame_done clock_reg frame_seq frame_t_us refresh_us"
+)
+REPORT_FMT = "<BbbBBHII"
+
+
+# Performance counters of CMD.STATS, in firmware order
+STAT_COUNTERS = ("loops", "rx_bytes", "frames", "overflows", "sync_resets", "dropped", "rx_passes", "rx_full")
+STAT_TIMINGS = ("tud_task", "vendor_task", "ui_board_poll", "send_fb", "dma", "work_task", "idle")
+STAT_FMT = "<I" + "I" * len(STAT_COUNTERS) + "IIII" * len(STAT_TIMINGS)
+
+
+# Flags of CMD.OLED_VSYNC
+class VSYNC(IntFlag):
+    # send a report when a frame is complete
+    REPORT = 1 << 0
+    # FB_MODE.BUFFERED: update the display once per estimated refresh
+    PACE = 1 << 1
+
+
+# Format of the framebuffer data on the bulk endpoint, selected with CMD.OLED_MODE
+class FB_MODE(IntEnum):
+    # complete 8192 byte framebuffers, separated by a 4 ms quiet period
+    RAW = 0
+    # messages with a header, can be sent back-to-back
+    PACKET = 1
+    # like PACKET, but drawn into a framebuffer on the device, which sends the changes to the display
+    BUFFERED = 2
+
+
+# Message types in FB_MODE.PACKET and BUFFERED
+class MSG(IntEnum):
+    # a complete framebuffer of 8192 bytes
+    FRAME = 0x01
+    # 4 byte window (x1, y1, x2, y2), followed by the pixels of that window
+    WINDOW = 0x02
+    # 4 byte window (x1, y1, x2, y2), followed by the PackBits compressed pixels of that window
+    WINDOW_RLE = 0x03
+    # drawing operations, see gui_primitives.DrawList (FB_MODE.BUFFERED only)
+    DRAW = 0x04
+    # glyph cache upload, see gui_primitives.make_font()
+    FONT = 0x05
+    # hardware scrolling (start, offset), ordered with the pixel data (FB_MODE.PACKET only)
+    SCROLL = 0x06
+
+
+MSG_MAGIC = 0xA5
+
+# Max. size of the data of one CMD.BATCH transfer
+BATCH_SIZE = 256
+
+W = 256
+H = 64
+
+
+def changed_bboxes(a: np.ndarray, b: np.ndarray, gap=4):
+    """bounding boxes [(x1, y1, x2, y2), ...] of the pixels which differ between two packed
+    4-bit framebuffers of shape (H, W // 2). Bands of changed rows which are separated by
+    more than gap unchanged rows get their own box. Returns an empty list if a == b.
+    x is aligned to the 4 pixel columns of the display controller.
+    """
+    return _bboxes(a != b, gap)
+
+
+def _bboxes(diff: np.ndarray, gap):
+    """changed_bboxes() of a boolean mask of the changed bytes"""
+    rows = np.flatnonzero(diff.any(axis=1))
+    if rows.size == 0:
+        return []
+
+    # split the changed rows into bands
+    splits = np.flatnonzero(np.diff(rows) > gap + 1) + 1
+    bboxes = []
+    for band in np.split(rows, splits):
+        y1, y2 = band[0], band[-1]
+        cols = np.flatnonzero(diff[y1 : y2 + 1].any(axis=0))
+        # 2 bytes = 4 pixels per display column
+        x1 = (cols[0] & ~1) * 2
+        x2 = (cols[-1] | 1) * 2 + 1
+        bboxes.append((int(x1), int(y1), int(x2), int(y2)))
+    return bboxes
+
+
+class FramePacker:
+    """packs 8-bit grayscale images into the 4-bit framebuffer format of the display, 2 pixels per byte,
+    without allocating new buffers for every frame. Also finds what changed since the previous frame.
+    """
+
+    def __init__(self, gap=4):
+        self.gap = gap  # see changed_bboxes()
+        # two framebuffers in turns, the current and the previous frame
+        self._bufs = [bytearray(H * W // 2) for _ in range(2)]
+        self._fbs = [np.frombuffer(b, dtype=np.uint8).reshape(H, W // 2) for b in self._bufs]
+        self._cur = 0
+        self._odd = np.empty((H, W // 2), dtype=np.uint8)
+        self._diff = np.empty((H, W // 2), dtype=bool)
+
+    @property
+    def buf(self) -> bytearray:
+        """the last packed frame, 8192 bytes. Overwritten by the next but one pack()."""
+        return self._bufs[self._cur]
+
+    def pack(self, img: Image.Image, diff=True):
+        """pack a 256 x 64 image, returns (fb, bboxes). fb is the packed frame as array of shape (H, W // 2),
+        a view onto buf. bboxes are the changed_bboxes() since the previous call, None if diff is False.
+        Images of mode "L" are used as they are, others get converted.
+        """
+        if img.mode != "L":
+            img = img.convert("L")
+        if img.size != (W, H):
+            raise ValueError(f"Image must be {W} x {H} pixels.")
+        src = np.asarray(img)
+        self._cur ^= 1
+        fb, prev = self._fbs[self._cur], self._fbs[self._cur ^ 1]
+        # even pixels in the upper nibble
+        np.bitwise_and(src[:, ::2], 0xF0, out=fb)
+        np.right_shift(src[:, 1::2], 4, out=self._odd)
+        np.bitwise_or(fb, self._odd, out=fb)
+        if not diff:
+            return fb, None
+        np.not_equal(fb, prev, out=self._diff)
+        return fb, _bboxes(self._diff, self.gap)
+
+
+def pack_depth(idx: np.ndarray, bits: int) -> bytes:
+    """pack pixel values (0 .. 2^bits - 1) for CMD.OLED_DEPTH with 1 or 2 bits / pixel, first pixel in the MSBs.
+    The pixels of a window are packed in one go, without padding between the rows.
+    """
+    per = 8 // bits
+    a = np.asarray(idx, dtype=np.uint8).ravel()
+    a = np.concatenate((a, np.zeros(-a.size % per, dtype=np.uint8))).reshape(-1, per)
+    shifts = np.arange(per - 1, -1, -1, dtype=np.uint8) * bits
+    return np.bitwise_or.reduce(a << shifts, axis=1).astype(np.uint8).tobytes()
+
+
+def packbits(data: bytes) -> bytes:
+    """PackBits compression, as decoded by the firmware for MSG.WINDOW_RLE.
+    Control byte n: 0 - 127: copy the next n + 1 bytes, 129 - 255: repeat the next byte 257 - n times.
+    """
+    a = np.frombuffer(data, dtype=np.uint8)
+    if a.size == 0:
+        return b""
+    # start index and length of each run of identical bytes
+    starts = np.concatenate(([0], np.flatnonzero(a[1:] != a[:-1]) + 1))
+    lengths = np.diff(np.append(starts, a.size))
+
+    out = bytearray()
+    lit_start = None  # start of pending literal bytes
+
+    def flush_literal(end):
+        for i in range(lit_start, end, 128):
+            chunk = data[i : min(i + 128, end)]
+            out.append(len(chunk) - 1)
+            out += chunk
+
+    for start, length in zip(starts.tolist(), lengths.tolist()):
+        if length < 3:
+            # too short to be worth a repeat
+            if lit_start is None:
+                lit_start = start
+            continue
+        if lit_start is not None:
+            flush_literal(start)
+            lit_start = None
+        while length > 0:
+            n = min(length, 128)
+            if n < 3:
+                # a short remainder becomes a literal
+                out.append(n - 1)
+                out += data[start : start + n]
+            else:
+                out.append(257 - n)
+                out.append(data[start])
+            start += n
+            length -= n
+    if lit_start is not None:
+        flush_literal(a.size)
+    return bytes(out)
 
 
 class UiBoard:
@@ -51,9 +275,85 @@ class UiBoard:
         self.dev = dev
         dev.set_configuration()
         self.led_state = 0  # {0, LEDB_B, LEDB_G, LEDB_R, 0, LEDA_B, LEDA_G, LEDA_R,}
+        self.fb_mode = FB_MODE.RAW
+        self.seq = 0  # sequence number of the next message in FB_MODE.PACKET
+        self.last_fb = None  # last packed framebuffer sent, to find changed pixels
+        self.start_line = 0  # display RAM row shown at the top
+        self.packer = FramePacker()
+        self.depth = 4  # bits / pixel of the uncompressed pixel data, see set_depth()
+        self.palette = None  # shade of each pixel value if depth < 4
+        self._batch = None  # commands collected by batch()
+
+    def _set(self, cmd: CMD, value, index=0):
+        """a command which can be batched"""
+        if self._batch is not None:
+            self._batch.append((cmd, value, index))
+        else:
+            self.dev.ctrl_transfer(REQ.H2D, cmd, value, index)
+
+    def _batch_begin(self):
+        self._batch = []
+
+    def _batch_end(self):
+        cmds, self._batch = self._batch, None
+        if cmds:
+            self.send_batch(cmds)
+
+    def _batch_abort(self):
+        self._batch = None
+
+    @contextmanager
+    def batch(self):
+        """collect the calls of set_led(), set_brightness(), set_inverted(), set_encoder_accel(), set_fb_rate()
+        and set_vsync() in a with block and send them in one control transfer when it ends:
+
+            with ui.batch():
+                ui.set_led(leda=1)
+                ui.set_brightness(8)
+
+        The firmware applies them in order, between two windows of the display data.
+        """
+        self._batch_begin()
+        try:
+            yield self
+        except BaseException:
+            self._batch_abort()
+            raise
+        self._batch_end()
+
+    def send_batch(self, cmds):
+        """send a list of commands (CMD, value, index) with one or more CMD.BATCH transfers, see batch()"""
+        data = b""
+        for cmd, value, index in cmds:
+            entry = struct.pack("<BBHH", cmd, 4, value, index)
+            if len(data) + len(entry) > BATCH_SIZE:
+                self.dev.ctrl_transfer(REQ.H2D, CMD.BATCH, 0, 0, data)
+                data = b""
+            data += entry
+        if data:
+            self.dev.ctrl_transfer(REQ.H2D, CMD.BATCH, 0, 0, data)
 
     def reset(self):
         self.dev.ctrl_transfer(REQ.H2D, CMD.RESET, 0, 0)
+        self.last_fb = None
+        self.start_line = 0
+
+    def set_fb_mode(self, mode: FB_MODE):
+        """select the framebuffer data format on the bulk endpoint.
+        In FB_MODE.PACKET and BUFFERED, send_img() only transmits the parts of the image which changed.
+        Switching to FB_MODE.BUFFERED clears the display.
+        """
+        self.dev.ctrl_transfer(REQ.H2D, CMD.OLED_MODE, mode, 0)
+        self.fb_mode = FB_MODE(mode)
+        self.last_fb = None
+
+    def set_fb_rate(self, interval_ms=16):
+        """FB_MODE.BUFFERED: minimum time between two updates of the display in [ms], 0 = no limit"""
+        self._set(CMD.OLED_FB_RATE, interval_ms, 0)
+
+    def flush(self):
+        """abort an incomplete bulk transfer. The next data starts a new frame / message."""
+        self.dev.ctrl_transfer(REQ.H2D, CMD.OLED_FLUSH, 0, 0)
 
     def set_led(self, leda=None, ledb=None):
         """set the LED color. Value is from 0 - 7"""
@@ -65,42 +365,310 @@ class UiBoard:
             self.led_state &= ~(7 << 4)
             self.led_state |= (ledb & 7) << 4
 
-        self.dev.ctrl_transfer(REQ.H2D, CMD.IO_LEDS, self.led_state, 0)
+        self._set(CMD.IO_LEDS, self.led_state, 0)
 
     def set_inverted(self, val=False):
         """invert the display (prevents burn-in if done periodically)"""
-        self.dev.ctrl_transfer(REQ.H2D, CMD.OLED_INVERTED, val, 0)
+        self._set(CMD.OLED_INVERTED, val, 0)
 
     def set_brightness(self, val=16):
         """set OLED brightness (0 = off, 1 - 16 = on)"""
-        self.dev.ctrl_transfer(REQ.H2D, CMD.OLED_BRIGHTNESS, val, 0)
+        self._set(CMD.OLED_BRIGHTNESS, val, 0)
+
+    def set_depth(self, bits=4, palette=None):
+        """bits / pixel (1, 2 or 4) of the uncompressed pixel data of send_fb(), send_window() and scroll_rows().
+        With 1 and 2, the firmware expands each pixel value v to the shade palette[v] (0 - 15), by default evenly
+        spread from black to white. A full frame then only takes 1 or 2 kB. Compressed windows stay at 4 bits,
+        so send_img() sends full frames, with each pixel mapped to the closest shade of the palette.
+        Aborts an incomplete bulk transfer, like flush().
+        """
+        if bits == 4:
+            palette = None
+        elif bits in (1, 2):
+            if palette is None:
+                palette = [v * 15 // ((1 << bits) - 1) for v in range(1 << bits)]
+            if len(palette) != 1 << bits or not all(0 <= v <= 15 for v in palette):
+                raise ValueError(f"palette must be {1 << bits} shades of 0 - 15.")
+        else:
+            raise ValueError("bits must be 1, 2 or 4.")
+        self.dev.ctrl_transfer(REQ.H2D, CMD.OLED_DEPTH, bits, 0, bytes(palette) if palette is not None else None)
+        self.depth = bits
+        self.palette = palette
+        self.last_fb = None
+
+    def set_gamma(self, table=None):
+        """load a custom gamma table: the pulse widths of shades 1 - 15, 15 ascending values of 0 - 180.
+        None restores the default one. Takes effect once the window being written is complete.
+        """
+        if table is None:
+            self.dev.ctrl_transfer(REQ.H2D, CMD.OLED_GAMMA, 0, 0)
+            return
+        table = list(table)
+        if len(table) != 15 or table != sorted(table) or table[0] < 0 or table[-1] > 180:
+            raise ValueError("table must be 15 ascending values of 0 - 180.")
+        self.dev.ctrl_transfer(REQ.H2D, CMD.OLED_GAMMA, 0, 0, bytes(table))
 
     def get_fw_version(self):
         """return firmware version string (output from git describe)"""
         data = self.dev.ctrl_transfer(REQ.D2H, CMD.VERSION, 0, 0, 64)
         return data.tobytes().decode("utf-8")
 
-    def get_inputs(self):
+    def get_stats(self, reset=False):
+        """return the firmware performance counters as dict, since the last reset (or boot).
+        t_ms: length of the measurement period, then the event counters (see STAT_COUNTERS),
+        then for each timed section (see STAT_TIMINGS) n calls and min / max / avg duration in [us].
+        Rates are per second, rx_bytes_per_pass is the average chunk vendor_task() took from the USB FIFO.
+        """
+        data = self.dev.ctrl_transfer(REQ.D2H, CMD.STATS, int(reset), 0, struct.calcsize(STAT_FMT))
+        vals = struct.unpack(STAT_FMT, data)
+        t_ms = vals[0]
+        ret = {"t_ms": t_ms}
+        for name, v in zip(STAT_COUNTERS, vals[1:]):
+            ret[name] = v
+            ret[name + "_per_s"] = v * 1000 / t_ms if t_ms else 0
+        ret["rx_bytes_per_pass"] = ret["rx_bytes"] / ret["rx_passes"] if ret["rx_passes"] else 0
+        timings = vals[1 + len(STAT_COUNTERS) :]
+        for i, name in enumerate(STAT_TIMINGS):
+            n, t_min, t_max, t_avg = timings[i * 4 : i * 4 + 4]
+            ret[name] = {"n": n, "min_us": t_min / 144, "max_us": t_max / 144, "avg_us": t_avg / 144}
+        return ret
+
+    def set_spi_clock(self, oled_div=16, mcp_div=16):
+        """set the SPI clock divider (2, 4, .. 256) of the OLED and the MCP23, 16 = 9 MHz is the default.
+        Both chips are specified up to 10 MHz, but may work faster with short cables.
+        The MCP23 link is tested by reading back a register. On failure, its clock goes back to
+        the default. Returns the number of failed readbacks (0 = ok).
+        There is no way to read back from the OLED, watch the display for glitches.
+        """
+
+        def br(div):
+            if div not in (2, 4, 8, 16, 32, 64, 128, 256):
+                raise ValueError(f"invalid SPI clock divider {div}")
+            return div.bit_length() - 2
+
+        # STALLs while a display transfer holds the bus
+        for retry in range(20):
+            try:
+                data = self.dev.ctrl_transfer(REQ.D2H, CMD.SPI_CLOCK, br(oled_div), br(mcp_div), 2)
+                break
+            except usb.core.USBError as e:
+                if e.errno != errno.EPIPE or retry == 19:
+                    raise
+                time.sleep(0.01)
+        n_tests, n_failed = struct.unpack("BB", data)
+        return n_failed
+
+    def set_encoder_accel(self, v0=10, gain=0):
+        """configure the encoder acceleration curve, applied to encoder_accel of get_inputs(accel=True).
+        When turned faster than v0 [detents / s], each detent counts as
+        1 + gain * (speed - v0) / 256 steps (max. 64). gain = 0 disables acceleration.
+        """
+        self._set(CMD.ENC_ACCEL, v0, gain)
+
+    def get_inputs(self, accel=False):
         """return state of user inputs since last call: button_flags, encoder_delta
         Call this for every frame of the GUI main-loop
-        button_flags indicates button events since last call:
+        button_flags indicates button events since last call (see BTN):
             {BTN1_LONG, BTN0_LONG, BTN1_SHORT, BTN0_SHORT, BTN1_STATE, BTN0_STATE}
+        A long press is reported once the button is held for ~350 ms, a short press on release.
         encoder_delta is the number of ticks since last call (sign indicates direction)
+        with accel=True, the accelerated ticks (see set_encoder_accel()) are returned as third value
         """
-        data = self.dev.ctrl_transfer(REQ.D2H, CMD.BTNS_ENC, 0, 0, 2)
-        button_flags, encoder_delta = struct.unpack("cb", data)
+        data = self.dev.ctrl_transfer(REQ.D2H, CMD.BTNS_ENC, 0, 0, 3)
+        button_flags, encoder_delta, encoder_accel = struct.unpack("Bbb", data)
+        if accel:
+            return button_flags, encoder_delta, encoder_accel
         return button_flags, encoder_delta
 
+    def get_events(self):
+        """return (events, lost): the list of input Events queued by the firmware since the last call,
+        oldest first, and the number of events dropped because the queue overflowed.
+        Every encoder step and button event is queued individually with its timestamp.
+        """
+        events = []
+        lost = 0
+        ev_size = struct.calcsize(EVENT_FMT)
+        while True:
+            data = self.dev.ctrl_transfer(REQ.D2H, CMD.EVENTS, 0, 0, 4 + MAX_EVENTS * ev_size).tobytes()
+            n, n_lost = struct.unpack("<HH", data[:4])
+            lost += n_lost
+            events += [Event(*e) for e in struct.iter_unpack(EVENT_FMT, data[4 : 4 + n * ev_size])]
+            # the firmware queue may hold more events than fit into one transfer
+            if n < MAX_EVENTS:
+                return events, lost
+
+    def read_inputs(self, timeout=100, accel=False):
+        """wait for an input report on the interrupt endpoint, the device only sends one when
+        an input changed. Returns button_flags, encoder_delta (, encoder_accel) like get_inputs(),
+        or None if there was no change within timeout [ms].
+        Note that get_inputs() and read_inputs() share the same accumulators, use only one of them.
+        """
+        try:
+            data = self.dev.read(0x81, 16, timeout)
+        except usb.core.USBTimeoutError:
+            return None
+        button_flags, encoder_delta, encoder_accel = struct.unpack("Bbb", data[:3])
+        if accel:
+            return button_flags, encoder_delta, encoder_accel
+        return button_flags, encoder_delta
+
+    def set_vsync(self, flags: VSYNC = VSYNC.REPORT):
+        """VSYNC.REPORT: also send a report on the interrupt endpoint when a frame has been completed.
+        VSYNC.PACE: in FB_MODE.BUFFERED, update the display once per refresh of the panel.
+        The panel has no tearing signal, so its refresh period is estimated from the clock register
+        and the phase is unknown.
+        """
+        self._set(CMD.OLED_VSYNC, flags, 0)
+
+    def read_report(self, timeout=100):
+        """wait for a report on the interrupt endpoint, sent when an input changed or a frame has been
+        completed (with VSYNC.REPORT). Returns a Report or None if there was none within timeout [ms].
+        """
+        try:
+            data = self.dev.read(0x81, 16, timeout)
+        except usb.core.USBTimeoutError:
+            return None
+        rep = Report(*struct.unpack(REPORT_FMT, data[: struct.calcsize(REPORT_FMT)]))
+        return rep._replace(frame_done=bool(rep.frame_done & 1))
+
+    def wait_frame(self, timeout=100):
+        """wait until the last frame sent is on the display (needs VSYNC.REPORT). Use this to render one frame
+        per display refresh. Returns the Report, including input changes which arrived meanwhile, or None on timeout.
+        """
+        flags, delta, accel = 0, 0, 0
+        while True:
+            rep = self.read_report(timeout)
+            if rep is None:
+                return None
+            # latest button state, all events
+            flags = (flags & ~3) | rep.button_flags
+            delta += rep.encoder_delta
+            accel += rep.encoder_accel
+            last = self.fb_mode == FB_MODE.RAW or rep.frame_seq == (self.seq - 1) & 0xFFFF
+            if rep.frame_done and last:
+                return rep._replace(button_flags=flags, encoder_delta=delta, encoder_accel=accel)
+
+    def _msg(self, msg_type: MSG, payload: bytes):
+        """wrap payload into a message for FB_MODE.PACKET"""
+        hdr = struct.pack("<BBHH", MSG_MAGIC, msg_type, self.seq, len(payload))
+        self.seq = (self.seq + 1) & 0xFFFF
+        return hdr + payload
+
+    def _window_msg(self, x1: int, y1: int, x2: int, y2: int, buf: bytes):
+        if x1 % 4 or (x2 + 1) % 4 or not (0 <= x1 <= x2 < W and 0 <= y1 <= y2 < H):
+            raise ValueError("Invalid window.")
+        if len(buf) != -(-(x2 - x1 + 1) * (y2 - y1 + 1) * self.depth // 8):
+            raise RuntimeError("Wrong window size.")
+        # use compression if it helps, the firmware only decompresses 4 bit pixels
+        rle = packbits(buf) if self.depth == 4 else buf
+        if len(rle) < len(buf):
+            return self._msg(MSG.WINDOW_RLE, struct.pack("BBBB", x1, y1, x2, y2) + rle)
+        return self._msg(MSG.WINDOW, struct.pack("BBBB", x1, y1, x2, y2) + buf)
+
     def send_fb(self, buf: bytes):
         # Send a frame-buffer to the OLED display
-        if len(buf) != 8192:
-            raise RuntimeError("Wrong framebuffer size. Must be 8192 bytes.")
+        if len(buf) != W * H * self.depth // 8:
+            raise RuntimeError(f"Wrong framebuffer size. Must be {W * H * self.depth // 8} bytes.")
+        if self.fb_mode != FB_MODE.RAW:
+            # a full screen window, compressed if possible
+            buf = self._window_msg(0, 0, W - 1, H - 1, buf)
         self.dev.write(1, buf)
 
+    def send_window(self, x1: int, y1: int, x2: int, y2: int, buf: bytes):
+        """Update a rectangular window of the display (needs FB_MODE.PACKET or BUFFERED).
+        Coordinates are inclusive, x1 must be a multiple of 4 and x2 + 1 too.
+        buf holds the pixels of the window, row by row, 2 pixels per byte.
+        """
+        if self.fb_mode == FB_MODE.RAW:
+            raise RuntimeError("Windowed updates need FB_MODE.PACKET or BUFFERED.")
+        self.dev.write(1, self._window_msg(x1, y1, x2, y2, buf))
+
+    def set_start_line(self, start=0, offset=0):
+        """scroll in hardware (not in FB_MODE.BUFFERED): the display shows RAM rows start .. start + 63,
+        wrapping around after row 127. offset shifts the COM lines by 0 - 127 rows.
+        In FB_MODE.PACKET it is a message, applied once the pixels sent before are in the display RAM,
+        in FB_MODE.RAW a command, applied once the window being written is complete.
+        Full frames and send_img() always write RAM rows 0 - 63, set start = 0 before using them.
+        """
+        if self.fb_mode == FB_MODE.PACKET:
+            self.dev.write(1, self._scroll_msg(start, offset))
+        else:
+            self.dev.ctrl_transfer(REQ.H2D, CMD.OLED_SCROLL, start, offset)
+        self.start_line = start % 128
+        self.last_fb = None
+
+    def _scroll_msg(self, start, offset):
+        return self._msg(MSG.SCROLL, bytes([start % 128, offset % 128]))
+
+    def scroll_rows(self, rows: bytes):
+        """scroll the display up in hardware (needs FB_MODE.PACKET). rows are the new pixel rows
+        appearing at the bottom, 256 pixels (128 bytes with depth 4) each, up to 64 of them.
+        Only these rows are sent, instead of the whole frame. The scroll follows them in the same transfer.
+        """
+        if self.fb_mode != FB_MODE.PACKET:
+            raise RuntimeError("Scrolling rows in needs FB_MODE.PACKET.")
+        row_size = W * self.depth // 8
+        n = len(rows) // row_size
+        if n * row_size != len(rows) or n > H:
+            raise ValueError(f"rows must be up to 64 rows of {row_size} bytes.")
+        # write the rows hidden below the display, the RAM wraps around after row 127
+        msgs = b""
+        y = (self.start_line + H) % 128
+        i = 0
+        while i < n:
+            k = min(n - i, 128 - y)
+            msgs += self._window_msg(0, y, W - 1, y + k - 1, rows[i * row_size : (i + k) * row_size])
+            y = (y + k) % 128
+            i += k
+        self.start_line = (self.start_line + n) % 128
+        self.dev.write(1, msgs + self._scroll_msg(self.start_line, 0))
+        self.last_fb = None
+
+    def send_font(self, font_data: bytes):
+        """upload a glyph cache made by gui_primitives.make_font(), used by DrawList.text()"""
+        if self.fb_mode == FB_MODE.RAW:
+            raise RuntimeError("Font upload needs FB_MODE.PACKET or BUFFERED.")
+        self.dev.write(1, self._msg(MSG.FONT, font_data))
+
+    def send_draw(self, draw_list):
+        """execute the operations of a gui_primitives.DrawList on the device framebuffer (needs FB_MODE.BUFFERED)"""
+        if self.fb_mode != FB_MODE.BUFFERED:
+            raise RuntimeError("Drawing needs FB_MODE.BUFFERED.")
+        msgs = b"".join(self._msg(MSG.DRAW, chunk) for chunk in draw_list.chunks())
+        if msgs:
+            self.dev.write(1, msgs)
+        # the next send_img() can't know what changed
+        self.last_fb = None
+
     def send_img(self, img: Image.Image):
-        """send a PIL Image to the display"""
-        arr = np.array(img, dtype=np.uint8)
-        arr4 = arr >> 4  # 8-bit → 4-bit
-        # Pack two pixels per byte
-        packed = (arr4[:, ::2] << 4) | arr4[:, 1::2]
-        self.send_fb(packed.flatten().tobytes())
+        """send a PIL Image to the display, preferably of mode "L" (8-bit grayscale)"""
+        if self.depth < 4:
+            self._send_img_palette(img)
+            return
+        # the packer diffs against its previous frame, which is last_fb
+        delta = self.fb_mode != FB_MODE.RAW and self.last_fb is not None
+        packed, bboxes = self.packer.pack(img, diff=delta)
+
+        if delta:
+            # only send what changed, all windows in one go
+            msgs = b""
+            for x1, y1, x2, y2 in bboxes:
+                win = packed[y1 : y2 + 1, x1 // 2 : x2 // 2 + 1]
+                msgs += self._window_msg(x1, y1, x2, y2, win.tobytes())
+            if msgs:
+                self.dev.write(1, msgs)
+        else:
+            self.send_fb(self.packer.buf)
+        self.last_fb = packed
+
+    def _send_img_palette(self, img: Image.Image):
+        """send_img() with depth < 4: map each pixel to the closest shade of the palette"""
+        if img.mode != "L":
+            img = img.convert("L")
+        if img.size != (W, H):
+            raise ValueError(f"Image must be {W} x {H} pixels.")
+        shades = np.asarray(img) >> 4
+        # pixel value of the closest palette entry for each of the 16 shades
+        lut = np.abs(np.arange(16)[:, None] - np.array(self.palette)[None, :]).argmin(axis=1).astype(np.uint8)
+        self.send_fb(pack_depth(lut[shades], self.depth))
+        self.last_fb = None
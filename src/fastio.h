@@ -0,0 +1,57 @@
+#pragma once
+#include "ch32v20x.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Direct register access to the GPIOs and SPI, for the hot paths. Does the same as the StdPeriph
+// functions, without a call and the parameter checks for each pin change or byte.
+
+static inline void gpio_set(GPIO_TypeDef *port, uint16_t pins) { port->BSHR = pins; }
+
+static inline void gpio_clear(GPIO_TypeDef *port, uint16_t pins) { port->BCR = pins; }
+
+static inline void gpio_write(GPIO_TypeDef *port, uint16_t pins, bool val) {
+    if (val)
+        port->BSHR = pins;
+    else
+        port->BCR = pins;
+}
+
+static inline bool gpio_read(GPIO_TypeDef *port, uint16_t pin) { return (port->INDR & pin) != 0; }
+
+// Hand val to the SPI as soon as its transmit buffer is free. Returns while it is still being
+// sent, so consecutive words go out back to back.
+static inline void spi_put(SPI_TypeDef *spi, uint16_t val) {
+    while (!(spi->STATR & SPI_STATR_TXE))
+        ;
+    spi->DATAR = val;
+}
+
+// Send n bytes back to back, see spi_put()
+static inline void spi_write(SPI_TypeDef *spi, const uint8_t *buf, unsigned n) {
+    for (; n > 0; n--)
+        spi_put(spi, *buf++);
+}
+
+// Wait until everything has been shifted out, before changing a chip select or D/C
+static inline void spi_wait_idle(SPI_TypeDef *spi) {
+    while (!(spi->STATR & SPI_STATR_TXE))
+        ;
+    while (spi->STATR & SPI_STATR_BSY)
+        ;
+}
+
+// Drop what was received while only sending and clear the overrun flag (read DATAR, then STATR),
+// so the next spi_xfer() returns fresh data
+static inline void spi_flush_rx(SPI_TypeDef *spi) {
+    (void)spi->DATAR;
+    (void)spi->STATR;
+}
+
+// Send val and return the word received meanwhile. The receive buffer must be empty.
+static inline uint16_t spi_xfer(SPI_TypeDef *spi, uint16_t val) {
+    spi_put(spi, val);
+    while (!(spi->STATR & SPI_STATR_RXNE))
+        ;
+    return spi->DATAR;
+}
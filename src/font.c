@@ -0,0 +1,45 @@
+#include "font.h"
+#include <stddef.h>
+
+static uint8_t font_mem[FONT_MEM_SIZE];
+
+// Header of the font in font_mem
+static unsigned font_first = 0, font_count = 0, font_h = 0;
+// Offset of each glyph bitmap in font_mem
+static uint16_t glyph_ofs[FONT_MAX_GLYPHS];
+
+uint8_t *font_buffer(void) {
+    // invalid while it is being overwritten
+    font_count = 0;
+    return font_mem;
+}
+
+bool font_load(unsigned len) {
+    font_count = 0;
+    if (len < 3 || font_mem[1] > FONT_MAX_GLYPHS || len < 3u + font_mem[1])
+        return false;
+
+    const unsigned first = font_mem[0], count = font_mem[1], h = font_mem[2];
+    const uint8_t *widths = &font_mem[3];
+    unsigned ofs = 3 + count;
+    for (unsigned i = 0; i < count; i++) {
+        glyph_ofs[i] = ofs;
+        ofs += (widths[i] + 7) / 8 * h;
+    }
+    if (ofs > len)
+        return false;
+
+    font_first = first;
+    font_h = h;
+    font_count = count;
+    return true;
+}
+
+const uint8_t *font_glyph(uint8_t c, unsigned *w, unsigned *h) {
+    if (c < font_first || c - font_first >= font_count)
+        return NULL;
+    const unsigned i = c - font_first;
+    *w = font_mem[3 + i];
+    *h = font_h;
+    return &font_mem[glyph_ofs[i]];
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Glyph cache in device RAM, uploaded by the host. Holds a range of characters of one font,
+// all with the same height, each with its own width.
+// Format: first, count, h, count x width, followed by the glyph bitmaps. A glyph is h rows of
+// 1 bpp, MSB = leftmost pixel, each row padded to full bytes (same as DRAW_BLIT).
+
+// Max. size of a font upload [bytes]
+#define FONT_MEM_SIZE 3072
+
+// Max. number of glyphs in the cache
+#define FONT_MAX_GLYPHS 128
+
+// Where the upload goes. Call font_load() when it's complete.
+uint8_t *font_buffer(void);
+
+// Check the uploaded data and make it the current font. Returns false if it is malformed,
+// the cache is empty then.
+bool font_load(unsigned len);
+
+// Bitmap of the glyph for character c and its width w, height h. NULL if not in the cache.
+const uint8_t *font_glyph(uint8_t c, unsigned *w, unsigned *h);
@@ -0,0 +1,310 @@
+#include "framebuffer.h"
+#include "font.h"
+#include "ssd1322.h"
+#include "timebase.h"
+#include <stdbool.h>
+#include <string.h>
+#include <sys/param.h>
+
+// Number of 4 pixel columns of the display
+#define FB_COLS (DISPLAY_WIDTH / 4)
+
+static uint8_t fb[DISPLAY_HEIGHT][FB_STRIDE];
+
+// Changed columns of each row, inclusive, in [4 pixel columns]. x1 > x2 if the row is clean.
+static uint8_t dirty_x1[DISPLAY_HEIGHT] = {[0 ... DISPLAY_HEIGHT - 1] = 0xFF};
+static uint8_t dirty_x2[DISPLAY_HEIGHT];
+static bool dirty = false;
+
+// fb_write() window in [bytes] / [rows] and its cursor
+static unsigned win_x1 = 0, win_x2 = FB_STRIDE - 1, win_y1 = 0, win_y2 = DISPLAY_HEIGHT - 1;
+static unsigned cur_x = 0, cur_y = 0;
+
+static unsigned flush_interval = 16;  // [ms]
+static unsigned flush_time = 0;       // start of the last flush
+static bool flushing = false;         // sending dirty bands until none are left
+static uint32_t vsync_us = 0;         // pace flushes at this period, 0 = off
+static uint32_t vsync_t = 0;          // last estimated refresh boundary [us]
+
+// Mark columns c1 - c2 of row y as changed
+static void mark_dirty(unsigned y, unsigned c1, unsigned c2) {
+    dirty_x1[y] = MIN(dirty_x1[y], c1);
+    dirty_x2[y] = MAX(dirty_x2[y], c2);
+    dirty = true;
+}
+
+void fb_window(unsigned x1, unsigned y1, unsigned x2, unsigned y2) {
+    // 4 pixels = 2 bytes per column
+    win_x1 = (x1 >> 2) * 2;
+    win_x2 = (x2 >> 2) * 2 + 1;
+    win_y1 = y1;
+    win_y2 = y2;
+    cur_x = win_x1;
+    cur_y = win_y1;
+}
+
+void fb_write(unsigned count, const uint8_t *buf) {
+    while (count > 0) {
+        const unsigned n = MIN(count, win_x2 + 1 - cur_x);
+        memcpy(&fb[cur_y][cur_x], buf, n);
+        mark_dirty(cur_y, cur_x / 2, (cur_x + n - 1) / 2);
+        buf += n;
+        count -= n;
+        cur_x += n;
+        if (cur_x > win_x2) {
+            cur_x = win_x1;
+            cur_y = (cur_y >= win_y2) ? win_y1 : cur_y + 1;
+        }
+    }
+}
+
+void fb_clear(void) {
+    memset(fb, 0, sizeof(fb));
+    fb_invalidate();
+}
+
+void fb_invalidate(void) {
+    for (unsigned y = 0; y < DISPLAY_HEIGHT; y++)
+        mark_dirty(y, 0, FB_COLS - 1);
+}
+
+void fb_set_interval(unsigned ms) { flush_interval = ms; }
+
+void fb_set_vsync(uint32_t period_us) {
+    vsync_us = period_us;
+    vsync_t = micros();
+}
+
+// ---------------------------------
+//  Drawing
+// ---------------------------------
+// Even pixels are in the upper nibble
+static unsigned get_px(unsigned x, unsigned y) {
+    const uint8_t v = fb[y][x / 2];
+    return (x & 1) ? v & 0x0F : v >> 4;
+}
+
+static void set_px(unsigned x, unsigned y, unsigned shade) {
+    uint8_t *p = &fb[y][x / 2];
+    *p = (x & 1) ? (*p & 0xF0) | shade : (*p & 0x0F) | (shade << 4);
+}
+
+// Mark a rectangle as changed, coordinates need to be clipped already
+static void mark_rect(unsigned x1, unsigned y1, unsigned x2, unsigned y2) {
+    for (unsigned y = y1; y <= y2; y++)
+        mark_dirty(y, x1 / 4, x2 / 4);
+}
+
+static void fill(unsigned x1, unsigned y1, unsigned x2, unsigned y2, unsigned shade) {
+    y2 = MIN(y2, DISPLAY_HEIGHT - 1);
+    if (x1 > x2 || y1 > y2)
+        return;
+    for (unsigned y = y1; y <= y2; y++) {
+        unsigned x = x1;
+        if (x & 1)
+            set_px(x++, y, shade);
+        // whole bytes in between
+        const unsigned n = (x2 + 1 - x) / 2;
+        memset(&fb[y][x / 2], shade * 0x11, n);
+        x += n * 2;
+        if (x <= x2)
+            set_px(x, y, shade);
+    }
+    mark_rect(x1, y1, x2, y2);
+}
+
+static void blit(unsigned x0,
+                 unsigned y0,
+                 unsigned w,
+                 unsigned h,
+                 unsigned fg,
+                 unsigned bg,
+                 const uint8_t *bits) {
+    const unsigned stride = (w + 7) / 8;
+    if (w == 0 || h == 0 || y0 >= DISPLAY_HEIGHT)
+        return;
+    const unsigned x2 = MIN(x0 + w - 1, DISPLAY_WIDTH - 1);
+    const unsigned y2 = MIN(y0 + h - 1, DISPLAY_HEIGHT - 1);
+    for (unsigned y = y0; y <= y2; y++, bits += stride) {
+        for (unsigned x = x0; x <= x2; x++) {
+            const unsigned i = x - x0;
+            if (bits[i / 8] & (0x80 >> (i & 7)))
+                set_px(x, y, fg);
+            else if (bg <= 15)
+                set_px(x, y, bg);
+        }
+    }
+    mark_rect(x0, y0, x2, y2);
+}
+
+static void scroll(unsigned x1,
+                   unsigned y1,
+                   unsigned x2,
+                   unsigned y2,
+                   int dx,
+                   int dy,
+                   unsigned shade) {
+    y2 = MIN(y2, DISPLAY_HEIGHT - 1);
+    if (x1 > x2 || y1 > y2)
+        return;
+    // Walk against the direction of movement, so every pixel is read before it's overwritten
+    const int step_x = (dx > 0) ? -1 : 1, step_y = (dy > 0) ? -1 : 1;
+    const int w = x2 - x1 + 1, h = y2 - y1 + 1;
+    for (int j = 0; j < h; j++) {
+        const int y = (step_y > 0) ? (int)y1 + j : (int)y2 - j;
+        const int sy = y - dy;
+        for (int i = 0; i < w; i++) {
+            const int x = (step_x > 0) ? (int)x1 + i : (int)x2 - i;
+            const int sx = x - dx;
+            if (sx >= (int)x1 && sx <= (int)x2 && sy >= (int)y1 && sy <= (int)y2)
+                set_px(x, y, get_px(sx, sy));
+            else
+                set_px(x, y, shade);
+        }
+    }
+    mark_rect(x1, y1, x2, y2);
+}
+
+// Number of parameter bytes of each operation
+static const uint8_t draw_args[DRAW_N] = {
+    [DRAW_PIXEL] = 3,
+    [DRAW_FILL] = 5,
+    [DRAW_HLINE] = 4,
+    [DRAW_VLINE] = 4,
+    [DRAW_BLIT] = 6,
+    [DRAW_SCROLL] = 7,
+    [DRAW_TEXT] = 5,
+};
+
+static void text(unsigned x, unsigned y, unsigned fg, unsigned bg, const uint8_t *s, unsigned n) {
+    for (unsigned i = 0; i < n && x < DISPLAY_WIDTH; i++) {
+        unsigned w, h;
+        const uint8_t *bits = font_glyph(s[i], &w, &h);
+        if (bits == NULL)
+            continue;
+        blit(x, y, w, h, fg, bg, bits);
+        x += w;
+    }
+}
+
+void fb_draw(const uint8_t *cmds, unsigned len) {
+    const uint8_t *end = cmds + len;
+
+    while (cmds < end) {
+        const unsigned op = cmds[0];
+        if (op >= DRAW_N || draw_args[op] == 0 || (unsigned)(end - cmds) < 1u + draw_args[op])
+            return;
+        const uint8_t *a = &cmds[1];
+        cmds += 1 + draw_args[op];
+
+        switch (op) {
+        case DRAW_PIXEL:
+            if (a[1] < DISPLAY_HEIGHT) {
+                set_px(a[0], a[1], a[2] & 0xF);
+                mark_dirty(a[1], a[0] / 4, a[0] / 4);
+            }
+            break;
+
+        case DRAW_FILL:
+            fill(a[0], a[1], a[2], a[3], a[4] & 0xF);
+            break;
+
+        case DRAW_HLINE:
+            fill(a[0], a[2], a[1], a[2], a[3] & 0xF);
+            break;
+
+        case DRAW_VLINE:
+            fill(a[0], a[1], a[0], a[2], a[3] & 0xF);
+            break;
+
+        case DRAW_BLIT: {
+            const unsigned n = (a[2] + 7) / 8 * a[3];
+            if ((unsigned)(end - cmds) < n)
+                return;
+            blit(a[0], a[1], a[2], a[3], a[4] & 0xF, a[5], cmds);
+            cmds += n;
+            break;
+        }
+
+        case DRAW_SCROLL:
+            scroll(a[0], a[1], a[2], a[3], (int8_t)a[4], (int8_t)a[5], a[6] & 0xF);
+            break;
+
+        case DRAW_TEXT:
+            if ((unsigned)(end - cmds) < a[4])
+                return;
+            text(a[0], a[1], a[2] & 0xF, a[3], cmds, a[4]);
+            cmds += a[4];
+            break;
+
+        default:
+            break;
+        }
+    }
+}
+
+// Send the first band of consecutive dirty rows, returns false if there is none
+static bool flush_band(void) {
+    unsigned y1 = 0;
+    while (y1 < DISPLAY_HEIGHT && dirty_x1[y1] > dirty_x2[y1])
+        y1++;
+    if (y1 >= DISPLAY_HEIGHT)
+        return false;
+
+    // one window for the whole band, covering the changed columns of all rows
+    unsigned y2 = y1, c1 = FB_COLS - 1, c2 = 0;
+    while (y2 < DISPLAY_HEIGHT && dirty_x1[y2] <= dirty_x2[y2]) {
+        c1 = MIN(c1, dirty_x1[y2]);
+        c2 = MAX(c2, dirty_x2[y2]);
+        dirty_x1[y2] = 0xFF;
+        dirty_x2[y2] = 0;
+        y2++;
+    }
+    send_rect(c1 * 4, y1, c2 * 4, y2 - 1, &fb[0][0], FB_STRIDE);
+    return true;
+}
+
+// Is it time for the next flush?
+static bool flush_due(void) {
+    if (vsync_us == 0)
+        return millis() - flush_time >= flush_interval;
+
+    const uint32_t dt = micros() - vsync_t;
+    if (dt < vsync_us)
+        return false;
+    // the next boundary, skipping the ones nothing was sent at
+    vsync_t += dt / vsync_us * vsync_us;
+    return true;
+}
+
+bool fb_pending(void) {
+    if (flushing)
+        return true;
+    if (!dirty)
+        return false;
+    // like flush_due(), without moving on the refresh boundary
+    if (vsync_us == 0)
+        return millis() - flush_time >= flush_interval;
+    return micros() - vsync_t >= vsync_us;
+}
+
+bool fb_busy(void) { return dirty || flushing; }
+
+bool fb_task(void) {
+    if (ssd1322_busy())
+        return false;
+
+    if (!flushing) {
+        if (!dirty || !flush_due())
+            return false;
+        flushing = true;
+        flush_time = millis();
+        dirty = false;
+    }
+
+    // Rows which change while flushing get picked up by this flush as well
+    if (flush_band())
+        return false;
+    flushing = false;
+    return true;
+}
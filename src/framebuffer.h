@@ -0,0 +1,59 @@
+#pragma once
+#include "ssd1322.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// Device-resident copy of the display content. Updates are written into it and only the
+// changed (dirty) parts are sent to the OLED by fb_task(), at most once per flush interval.
+
+// Bytes per row of the framebuffer, 4 bits / pixel
+#define FB_STRIDE (DISPLAY_WIDTH / 2)
+
+// Set the window for the following fb_write() calls, like set_window() for the display
+void fb_window(unsigned x1, unsigned y1, unsigned x2, unsigned y2);
+
+// Write count bytes of pixel data into the window, row by row. Wraps around at the end.
+void fb_write(unsigned count, const uint8_t *buf);
+
+// Clear the framebuffer and have all of it sent to the display
+void fb_clear(void);
+
+// Mark the whole framebuffer as changed, e.g. after the display was reset
+void fb_invalidate(void);
+
+// Drawing operations of fb_draw(), each opcode is followed by its parameter bytes.
+// Coordinates are in [pixels] and inclusive, shades are 0 - 15.
+enum {
+    DRAW_PIXEL = 0x01,   // x, y, shade
+    DRAW_FILL = 0x02,    // x1, y1, x2, y2, shade: fill a rectangle
+    DRAW_HLINE = 0x03,   // x1, x2, y, shade
+    DRAW_VLINE = 0x04,   // x, y1, y2, shade
+    DRAW_BLIT = 0x05,    // x, y, w, h, fg, bg, followed by h rows of a 1 bpp bitmap, MSB = leftmost
+                         // pixel, each row padded to full bytes. Clear bits are drawn with bg,
+                         // or left untouched if bg > 15.
+    DRAW_SCROLL = 0x06,  // x1, y1, x2, y2, int8 dx, int8 dy, shade: move the content of a
+                         // rectangle by dx, dy. Uncovered pixels are filled with shade.
+    DRAW_TEXT = 0x07,    // x, y, fg, bg, n, followed by n characters: draw a string with the
+                         // glyphs of the font cache, like DRAW_BLIT. y is the top of the glyphs.
+    DRAW_N
+};
+
+// Execute a list of drawing operations. Stops at the first malformed or incomplete one.
+void fb_draw(const uint8_t *cmds, unsigned len);
+
+// Minimum time between the start of two flushes in [ms], 0 = as fast as possible
+void fb_set_interval(unsigned ms);
+
+// Start flushes on the estimated refresh boundaries of the panel, every period_us. Overrides
+// the flush interval. 0 = off.
+void fb_set_vsync(uint32_t period_us);
+
+// true if fb_task() has something to send now
+bool fb_pending(void);
+
+// true while there are changes which have not been sent yet, e.g. waiting for the flush interval
+bool fb_busy(void);
+
+// Call in main loop. Sends the dirty parts to the display. Don't call it while
+// something else writes to the display. Returns true when a flush has been completed.
+bool fb_task(void);
@@ -1,41 +1,18 @@
 #include "main.h"
 #include "ch32v20x.h"
+#include "ch32v20x_dma.h"
+#include "ch32v20x_exti.h"
 #include "ch32v20x_gpio.h"
 #include "ch32v20x_spi.h"
+#include "sched.h"
+#include "stats.h"
 #include "tusb.h"
 #include "ui_board.h"
 #include "usb_interface.h"
+#include "work.h"
 #include <assert.h>
 #include <stdint.h>
 
-// -----------------------------
-//  Systick interrupt
-// -----------------------------
-volatile uint32_t system_ticks = 0;
-
-__attribute__((interrupt)) void SysTick_Handler(void) {
-    SysTick->SR = 0;
-    system_ticks++;
-}
-
-static uint32_t SysTick_Config(uint32_t ticks) {
-    NVIC_EnableIRQ(SysTicK_IRQn);
-    SysTick->CTLR = 0;
-    SysTick->SR = 0;
-    SysTick->CNT = 0;
-    SysTick->CMP = ticks - 1;
-    SysTick->CTLR = 0xF;
-    return 0;
-}
-
-unsigned millis(void) { return system_ticks; }
-
-void delay_ms(unsigned val) {
-    unsigned t2 = millis() + val;
-    while (millis() < t2)
-        ;
-}
-
 // -----------------------------
 //  USB interrupts
 // -----------------------------
@@ -59,12 +36,13 @@ __attribute__((interrupt)) __attribute__((used)) void USBWakeUp_IRQHandler(void)
 }
 
 static void peripherals_init(void) {
-    SysTick_Config(SystemCoreClock / 1000);
+    timebase_init();
 
     // --------
     //  GPIOA
     // --------
-    RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA, ENABLE);
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA | RCC_APB2Periph_AFIO | RCC_APB2Periph_SPI1,
+                           ENABLE);
     GPIO_InitTypeDef gpio = {0};
 
     // INT_IO = PA0
@@ -105,6 +83,18 @@ static void peripherals_init(void) {
     gpio.GPIO_Mode = GPIO_Mode_AF_PP;
     GPIO_Init(GPIOA, &gpio);
 
+    // --------
+    //  EXTI
+    // --------
+    // INT_IO (active high) triggers EXTI0. The IRQ is enabled by ui_init_step().
+    GPIO_EXTILineConfig(GPIO_PortSourceGPIOA, GPIO_PinSource0);
+    EXTI_InitTypeDef exti = {0};
+    exti.EXTI_Line = EXTI_Line0;
+    exti.EXTI_Mode = EXTI_Mode_Interrupt;
+    exti.EXTI_Trigger = EXTI_Trigger_Rising;
+    exti.EXTI_LineCmd = ENABLE;
+    EXTI_Init(&exti);
+
     // --------
     //  SPI
     // --------
@@ -112,8 +102,29 @@ static void peripherals_init(void) {
     SPI_StructInit(&spi_cfg);
     spi_cfg.SPI_Mode = SPI_Mode_Master;
     spi_cfg.SPI_DataSize = SPI_DataSize_16b;
-    spi_cfg.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_16;  // 9 MHz I think
+    spi_cfg.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_16;  // 9 MHz, then set per device
     SPI_Init(SPI1, &spi_cfg);
+    SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx, ENABLE);
+    SPI_Cmd(SPI1, ENABLE);
+
+    // --------
+    //  DMA
+    // --------
+    // SPI1_TX is on channel 3, used to stream framebuffer data to the OLED
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+    DMA_InitTypeDef dma_cfg = {0};
+    dma_cfg.DMA_PeripheralBaseAddr = (uint32_t)&SPI1->DATAR;
+    dma_cfg.DMA_DIR = DMA_DIR_PeripheralDST;
+    dma_cfg.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    dma_cfg.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    dma_cfg.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    dma_cfg.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    dma_cfg.DMA_Mode = DMA_Mode_Normal;
+    dma_cfg.DMA_Priority = DMA_Priority_High;
+    dma_cfg.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(DMA1_Channel3, &dma_cfg);
+    DMA_ITConfig(DMA1_Channel3, DMA_IT_TC, ENABLE);
+    NVIC_EnableIRQ(DMA1_Channel3_IRQn);
 
     // --------
     //  USB
@@ -123,6 +134,24 @@ static void peripherals_init(void) {
     RCC_APB1PeriphClockCmd(RCC_APB1Periph_USB, ENABLE);  // FSDEV
 }
 
+// tud_task() is inline
+static void usb_task(void) { tud_task(); }
+
+// Main loop tasks, highest priority first: input latency matters most, then USB. Budgets
+// per ms keep one of them from starving the others when it's busy all the time.
+static sched_task_t tasks[] = {
+    {.run = ui_board_poll,
+     .ready = ui_board_pending,
+     .budget = 200 * CYCLES_PER_US,
+     .stat_id = STAT_UI_POLL},
+    {.run = usb_task,
+     .ready = tud_task_event_ready,
+     .budget = 400 * CYCLES_PER_US,
+     .stat_id = STAT_TUD},
+    {.run = vendor_task, .ready = vendor_pending, .budget = 0, .stat_id = STAT_VENDOR},
+    {.run = work_task, .ready = work_queued, .budget = 0, .stat_id = STAT_WORK},
+};
+
 // Call this in your main loop
 int main(void) {
     __disable_irq();
@@ -135,9 +164,5 @@ int main(void) {
     // Init tiny-USB
     tud_init(BOARD_TUD_RHPORT);
 
-    while (1) {
-        tud_task();
-        vendor_task();
-        ui_board_poll();
-    }
+    sched_run(tasks, sizeof(tasks) / sizeof(tasks[0]));
 }
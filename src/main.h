@@ -1,4 +1,6 @@
 #pragma once
+#include "timebase.h"
+#include <stdint.h>
 
 #define PIN_INT_IO GPIO_Pin_0
 #define PIN_RES_N GPIO_Pin_1
@@ -8,6 +10,3 @@
 #define PIN_SCK GPIO_Pin_5
 #define PIN_SDI GPIO_Pin_6
 #define PIN_SDO GPIO_Pin_7
-
-unsigned millis(void);
-void delay_ms(unsigned val);
@@ -0,0 +1,57 @@
+#include "sched.h"
+#include "ch32v20x.h"
+#include "stats.h"
+#include "timebase.h"
+#include <stddef.h>
+
+static bool task_ready(const sched_task_t *t) { return t->ready == NULL || t->ready(); }
+
+// Sleep until an interrupt, unless a task became ready in the meantime
+static void idle(sched_task_t *tasks, unsigned n) {
+    const uint32_t t = cycles();
+    // The interrupt which makes a task ready could hit between checking and WFI, which
+    // would then sleep until the next one. With interrupts disabled, it stays pending
+    // and WFI returns right away.
+    __disable_irq();
+    bool sleep = true;
+    for (unsigned i = 0; i < n && sleep; i++)
+        sleep = !task_ready(&tasks[i]);
+    if (sleep)
+        __WFI();
+    __enable_irq();
+    stat_time(STAT_IDLE, t);
+}
+
+void sched_run(sched_task_t *tasks, unsigned n) {
+    while (1) {
+        const unsigned now = millis();
+        sched_task_t *next = NULL, *over = NULL;
+        for (unsigned i = 0; i < n; i++) {
+            sched_task_t *t = &tasks[i];
+            if (t->tick != now) {
+                t->tick = now;
+                t->used = 0;
+            }
+            if (!task_ready(t))
+                continue;
+            if (t->budget == 0 || t->used < t->budget) {
+                next = t;
+                break;
+            }
+            // out of budget, only if nobody else wants to run
+            if (over == NULL)
+                over = t;
+        }
+        if (next == NULL)
+            next = over;
+
+        stat_count(CNT_LOOPS, 1);
+        if (next == NULL) {
+            idle(tasks, n);
+            continue;
+        }
+        const uint32_t t = cycles();
+        next->run();
+        next->used += stat_time(next->stat_id, t) - t;
+    }
+}
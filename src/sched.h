@@ -0,0 +1,19 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Cooperative scheduler for the main loop. Each pass runs the highest priority task which
+// is ready and has budget left in the current SysTick period. Once a task used its budget,
+// lower priority tasks get their turn first. If nothing is ready, the CPU sleeps until the
+// next interrupt (the SysTick one at the latest).
+typedef struct {
+    void (*run)(void);
+    bool (*ready)(void);  // true if run() has something to do, NULL = always
+    uint32_t budget;      // max. run time per ms before it yields [clock-cycles], 0 = no limit
+    unsigned stat_id;     // STAT_* to record the run time in
+    uint32_t used;        // run time in the current ms
+    unsigned tick;        // ms used refers to
+} sched_task_t;
+
+// Run the tasks forever, highest priority first in the array
+void sched_run(sched_task_t *tasks, unsigned n) __attribute__((noreturn));
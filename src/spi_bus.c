@@ -0,0 +1,85 @@
+#include "spi_bus.h"
+#include "ch32v20x_spi.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// SPI1 settings which differ between the devices
+typedef struct {
+    uint16_t nss;
+    uint16_t data_size;
+    uint16_t prescaler;  // BR bits of CTLR1, same as SPI_BaudRatePrescaler_*
+} spi_profile_t;
+
+// SSD1322 and MCP23S17 are both specified for 10 MHz max.
+// Both often work faster with short cables, see spi_bus_set_clock().
+static spi_profile_t profiles[SPI_DEV_N] = {
+    [SPI_DEV_OLED] = {.nss = SPI_NSS_Soft,
+                      .data_size = SPI_DataSize_8b,
+                      .prescaler = SPI_BR_DEFAULT << 3},
+    [SPI_DEV_MCP] = {.nss = SPI_NSS_Hard,
+                     .data_size = SPI_DataSize_16b,
+                     .prescaler = SPI_BR_DEFAULT << 3},
+};
+
+// who holds the bus right now
+static volatile spi_dev_t owner = SPI_DEV_NONE;
+// who SPI1 is currently configured for
+static spi_dev_t configured = SPI_DEV_NONE;
+// called once the bus gets released, set by a failed spi_bus_try_acquire()
+static void (*volatile waiters[SPI_DEV_N])(void);
+
+// Switch the SPI1 settings over to dev, only if needed
+static void spi_configure(spi_dev_t dev) {
+    if (dev == configured)
+        return;
+    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
+        ;
+    SPI_NSSInternalSoftwareConfig(SPI1, profiles[dev].nss);
+    SPI_DataSizeConfig(SPI1, profiles[dev].data_size);
+    // the clock can only be changed while the SPI is disabled
+    if ((SPI1->CTLR1 & SPI_CTLR1_BR) != profiles[dev].prescaler) {
+        SPI_Cmd(SPI1, DISABLE);
+        SPI1->CTLR1 = (SPI1->CTLR1 & ~SPI_CTLR1_BR) | profiles[dev].prescaler;
+        SPI_Cmd(SPI1, ENABLE);
+    }
+    configured = dev;
+}
+
+void spi_bus_acquire(spi_dev_t dev) {
+    // Interrupt handlers only take the bus for the duration of their call,
+    // so once it's free here, it stays free.
+    while (owner != SPI_DEV_NONE)
+        ;
+    owner = dev;
+    spi_configure(dev);
+}
+
+bool spi_bus_try_acquire(spi_dev_t dev, void (*wake)(void)) {
+    if (owner != SPI_DEV_NONE) {
+        if (wake != NULL)
+            waiters[dev] = wake;
+        return false;
+    }
+    owner = dev;
+    spi_configure(dev);
+    return true;
+}
+
+void spi_bus_release(void) {
+    owner = SPI_DEV_NONE;
+    for (unsigned i = 0; i < SPI_DEV_N; i++) {
+        void (*wake)(void) = waiters[i];
+        if (wake != NULL) {
+            waiters[i] = NULL;
+            wake();
+        }
+    }
+}
+
+spi_dev_t spi_bus_owner(void) { return owner; }
+
+void spi_bus_set_clock(spi_dev_t dev, unsigned br) {
+    profiles[dev].prescaler = (br & 7) << 3;
+    // apply it on the next acquire
+    configured = SPI_DEV_NONE;
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Devices sharing SPI1
+typedef enum {
+    SPI_DEV_NONE = 0,
+    SPI_DEV_OLED,  // SSD1322, soft NSS, 8 bit
+    SPI_DEV_MCP,   // MCP23S17, hard NSS, 16 bit
+    SPI_DEV_N
+} spi_dev_t;
+
+// Claim SPI1 for dev, waiting for the current owner (e.g. an ongoing DMA transfer) to release it.
+// Don't call this from an interrupt handler.
+void spi_bus_acquire(spi_dev_t dev);
+
+// Claim SPI1 for dev if it is free. Otherwise returns false and, if wake is not NULL,
+// calls it once the bus gets released. Use this from interrupt handlers.
+bool spi_bus_try_acquire(spi_dev_t dev, void (*wake)(void));
+
+// Give the bus back, can be called from an interrupt handler (e.g. DMA transfer complete).
+// The SPI configuration is kept, so the next transfer by the same device needs no setup.
+void spi_bus_release(void);
+
+// The device currently holding the bus
+spi_dev_t spi_bus_owner(void);
+
+// Default clock setting of all devices, 9 MHz
+#define SPI_BR_DEFAULT 3
+
+// Set the SPI clock used while dev holds the bus to PCLK2 / 2^(br + 1), br = 0 - 7.
+// With 144 MHz that's 72 MHz (0) down to 562.5 kHz (7).
+void spi_bus_set_clock(spi_dev_t dev, unsigned br);
@@ -1,147 +1,294 @@
 #include "ssd1322.h"
+#include "ch32v20x_dma.h"
 #include "ch32v20x_spi.h"
+#include "fastio.h"
 #include "main.h"
-#include "ui_board.h"
+#include "spi_bus.h"
+#include "stats.h"
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 // set data/command pin of display, 0 = command, 1 = data
-#define D_C(val) GPIO_WriteBit(GPIOA, PIN_D_C, val)
+#define D_C(val) gpio_write(GPIOA, PIN_D_C, val)
 
 // Set the CS_N pin
-#define CS_N(val) GPIO_WriteBit(GPIOA, PIN_CS_OLED_N, val)
+#define CS_N(val) gpio_write(GPIOA, PIN_CS_OLED_N, val)
 
 static void spi_config_oled(void) {
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
-    SPI_NSSInternalSoftwareConfig(SPI1, SPI_NSS_Soft);
-    SPI_DataSizeConfig(SPI1, SPI_DataSize_8b);
+    // waits for a previous DMA transfer to finish
+    spi_bus_acquire(SPI_DEV_OLED);
 }
 
+static void spi_release_oled(void) {
+    CS_N(1);
+    spi_bus_release();
+}
+
+// Display clock: divide ratio in the lower nibble, oscillator frequency in the upper one
+#define CLOCK_REG 0x91
+
+// Command sequences are runs of: command byte, number of data bytes, the data bytes.
+// The compiler counts the data, so a missing comma can't shift the rest of the table.
+#define RUN(cmd, ...) cmd, sizeof((const uint8_t[]){__VA_ARGS__}), __VA_ARGS__
+#define RUN0(cmd) cmd, 0
+
+// Custom gamma table, gray levels GS1 - GS15
+#define GAMMA_DEFAULT 0, 1, 4, 8, 15, 23, 33, 45, 59, 74, 92, 111, 132, 155, 180
+
 // Initialization for NHD-2.8-25664UCB2 OLED display
-// negative = command, positive = data
 // clang-format off
-static const int16_t init[] = {
-    -0xFD, 0x12,     // Unlock OLED driver IC
-    -0xAE,           // Display OFF (blank)
-    -0x15, 0x1C, 0x5B,  // Set column address to 1C, 5B
-    -0x75, 0x00, 0x3F,  // Set row address to 00, 3F
-    -0xB3, 0x91,     // set clock to 80 fps
-    -0xCA, 0x3F,     // Multiplex ratio, 1/64, 64 COMS enabled
-    -0xA2, 0x00,     // Set offset, the display map starting line is COM0
-    -0xA1, 0x00,     // Set start line position
-    -0xA0, 0x14, 0x11,   // Set remap, horiz address increment, disable colum address remap,
-                     //  enable nibble remap, scan from com[N-1] to COM0, disable COM split odd even
-    -0xB5, 0x00,     // Disable GPIO inputs
-    -0xAB, 0x01,     // Select external VDD
-    -0xB4, 0xA0, 0xB5,   // Display enhancement A, 0xA0: external VSL, 0xA2: internal VSL, 0xB5: normal, 0xFD: enhanced low GS
-    -0xC1, 0x7F,     // Contrast current, 256 steps, default is 0x7F
-    -0xC7, 0x08,     // Master contrast current (brightness), 16 steps, default is 0x0F
+static const uint8_t init_seq[] = {
+    RUN(0xFD, 0x12),        // Unlock OLED driver IC
+    RUN0(0xAE),             // Display OFF (blank)
+    RUN(0x15, 0x1C, 0x5B),  // Set column address to 1C, 5B
+    RUN(0x75, 0x00, 0x3F),  // Set row address to 00, 3F
+    RUN(0xB3, CLOCK_REG),   // set clock to 80 fps
+    RUN(0xCA, 0x3F),        // Multiplex ratio, 1/64, 64 COMS enabled
+    RUN(0xA2, 0x00),        // Set offset, the display map starting line is COM0
+    RUN(0xA1, 0x00),        // Set start line position
+    RUN(0xA0, 0x14, 0x11),  // Set remap, horiz address increment, disable colum address remap,
+                            //  enable nibble remap, scan from com[N-1] to COM0, disable COM split odd even
+    RUN(0xB5, 0x00),        // Disable GPIO inputs
+    RUN(0xAB, 0x01),        // Select external VDD
+    RUN(0xB4, 0xA0, 0xB5),  // Display enhancement A, 0xA0: external VSL, 0xA2: internal VSL, 0xB5: normal, 0xFD: enhanced low GS
+    RUN(0xC1, 0x7F),        // Contrast current, 256 steps, default is 0x7F
+    RUN(0xC7, 0x08),        // Master contrast current (brightness), 16 steps, default is 0x0F
     // Load custom gamma table
-    -0xB8, 0, 1, 4, 8, 15, 23, 33, 45, 59, 74, 92, 111, 132, 155, 180,
-    // -0xB9,           // load default gamma table
-    -0xB1, 0xF4,     // Reset period / first pre-charge period Length
-    // -0xD1, 0x82, 0x20    // Display enhancement B
-    -0xD1, 0xa2, 0x20    // Display enhancement B
-    -0xBB, 0x17,     // Pre-charge voltage
-    -0xB6, 0x08,     // Second pre-charge period = 8 clks
-    -0xBE, 0x04,     // VCOMH: Set Common Pins Deselect Voltage Level as 0.8 * VCC
-    -0xA6,           // Normal display
-    -0xA9,           // Disable partial display mode
-    -0xAF            // Display ON
+    RUN(0xB8, GAMMA_DEFAULT),
+    // RUN0(0xB9),          // load default gamma table
+    RUN(0xB1, 0xF4),        // Reset period / first pre-charge period Length
+    // RUN(0xD1, 0x82, 0x20),  // Display enhancement B
+    RUN(0xD1, 0xa2, 0x20),  // Display enhancement B
+    RUN(0xBB, 0x17),        // Pre-charge voltage
+    RUN(0xB6, 0x08),        // Second pre-charge period = 8 clks
+    RUN(0xBE, 0x04),        // VCOMH: Set Common Pins Deselect Voltage Level as 0.8 * VCC
+    RUN0(0xA6),             // Normal display
+    RUN0(0xA9),             // Disable partial display mode
+    RUN0(0xAF),             // Display ON
+    RUN0(0x00),             // enable custom gamma table
 };
 // clang-format on
 
-// Write a 8 bit register
-static void ssd1322_write8(uint8_t val) {
-    SPI_I2S_SendData(SPI1, val);
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
-}
-
 static void send_cmd(uint8_t val) {
     D_C(0);
-    ssd1322_write8(val);
+    spi_put(SPI1, val);
+    spi_wait_idle(SPI1);
     D_C(1);
 }
 
-static void send_init(const int16_t *init, unsigned len) {
-    for (unsigned i = 0; i < len; i++) {
-        if (*init < 0)
-            send_cmd(-(*init));
-        else
-            ssd1322_write8(*init);
-        init++;
+// Send the runs of seq, polling the SPI. For the short sequences, where a DMA transfer
+// would cost more than it saves. The data bytes are written as soon as the SPI takes them.
+static void send_runs(const uint8_t *seq, unsigned len) {
+    const uint8_t *end = seq + len;
+    while (seq < end) {
+        send_cmd(seq[0]);
+        spi_write(SPI1, seq + 2, seq[1]);
+        seq += 2 + seq[1];
+        spi_wait_idle(SPI1);
     }
-    send_cmd(0x00);  // enable custom gamma table
+}
+
+void set_gamma(const uint8_t *table) {
+    uint8_t seq[] = {
+        RUN(0xB8, GAMMA_DEFAULT),  // load custom gamma table
+        RUN0(0x00),                // enable it
+    };
+    if (table != NULL)
+        memcpy(seq + 2, table, GAMMA_LEVELS);
+    spi_config_oled();
+    CS_N(0);
+    send_runs(seq, sizeof(seq));
+    spi_release_oled();
+}
+
+// Rows of a send_rect() transfer, the DMA interrupt starts one after the other
+static const uint8_t *chain_buf;
+static unsigned chain_rows = 0, chain_len = 0, chain_stride = 0;
+static uint32_t t_dma = 0;  // start of the transfer, for the stats
+
+// Rest of the init sequence, the DMA interrupt continues it after each data run
+static const uint8_t *seq_p, *seq_end;
+
+static void dma_start(const uint8_t *buf, unsigned count) {
+    DMA_Cmd(DMA1_Channel3, DISABLE);
+    DMA1_Channel3->MADDR = (uint32_t)buf;
+    DMA_SetCurrDataCounter(DMA1_Channel3, count);
+    DMA_Cmd(DMA1_Channel3, ENABLE);
+}
+
+// Send the command bytes of the next runs until one has data, which is started by DMA.
+// Returns false when the sequence is done.
+static bool seq_step(void) {
+    while (seq_p < seq_end) {
+        const uint8_t cmd = seq_p[0], n = seq_p[1];
+        const uint8_t *data = seq_p + 2;
+        seq_p = data + n;
+        send_cmd(cmd);
+        if (n > 0) {
+            dma_start(data, n);
+            return true;
+        }
+    }
+    return false;
 }
 
 void init_ssd1322(void) {
     spi_config_oled();
     CS_N(0);
-    D_C(1);
-    send_init(init, sizeof(init) / sizeof(init[0]));
-    CS_N(1);
+    chain_rows = 0;
+    seq_p = init_seq;
+    seq_end = init_seq + sizeof(init_seq);
+    t_dma = cycles();
+    if (!seq_step())
+        spi_release_oled();
 }
 
 void set_brightness(uint8_t val) {
     spi_config_oled();
     CS_N(0);
     if (val == 0) {
-        send_cmd(0xAE);  // display off
+        const uint8_t seq[] = {RUN0(0xAE)};  // display off
+        send_runs(seq, sizeof(seq));
     } else {
-        send_cmd(0xAF);  // display on
-        send_cmd(0xC7);  // set brightness (0 - 15)
-        ssd1322_write8(val - 1);
+        const uint8_t seq[] = {
+            RUN0(0xAF),          // display on
+            RUN(0xC7, val - 1),  // set brightness (0 - 15)
+        };
+        send_runs(seq, sizeof(seq));
     }
-    CS_N(1);
+    spi_release_oled();
 }
 
 void set_inverted(bool val) {
+    const uint8_t seq[] = {RUN0(val ? 0xA7 : 0xA6)};
     spi_config_oled();
     CS_N(0);
-    send_cmd(val ? 0xA7 : 0xA6);
-    CS_N(1);
+    send_runs(seq, sizeof(seq));
+    spi_release_oled();
+}
+
+void set_start_line(unsigned start, unsigned offset) {
+    const uint8_t seq[] = {
+        RUN(0xA1, start & 0x7F),   // display start line
+        RUN(0xA2, offset & 0x7F),  // display offset
+    };
+    spi_config_oled();
+    CS_N(0);
+    send_runs(seq, sizeof(seq));
+    spi_release_oled();
+}
+
+// set_window() on an acquired bus
+static void send_window(unsigned x1, unsigned y1, unsigned x2, unsigned y2) {
+    // truncate the 2 LSBs
+    const uint8_t seq[] = {
+        RUN(0x15, 0x1C + (x1 >> 2), 0x1C + (x2 >> 2)),  // Set column address range
+        RUN(0x75, y1, y2),                              // Set row address range
+    };
+    send_runs(seq, sizeof(seq));
 }
 
-void send_fb(bool prefix_cmd, unsigned count, uint8_t *buf) {
+void send_fb(bool prefix_cmd, unsigned count, const uint8_t *buf) {
+    const uint32_t t = cycles();
     spi_config_oled();
     CS_N(0);
     if (prefix_cmd)
         send_cmd(0x5C);  // write VRAM command
-    for (unsigned i = 0; i < count; i++)
-        ssd1322_write8(*buf++);
-    CS_N(1);
+
+    if (count == 0) {
+        spi_release_oled();
+        stat_time(STAT_SEND_FB, t);
+        return;
+    }
+
+    // The rest is done by DMA, the bus is released in the interrupt handler
+    chain_rows = 0;
+    t_dma = stat_time(STAT_SEND_FB, t);
+    dma_start(buf, count);
+}
+
+void send_rect(unsigned x1,
+               unsigned y1,
+               unsigned x2,
+               unsigned y2,
+               const uint8_t *buf,
+               unsigned stride) {
+    const uint32_t t = cycles();
+    const unsigned len = ((x2 >> 2) - (x1 >> 2) + 1) * 2;
+    unsigned rows = y2 - y1 + 1;
+    buf += y1 * stride + (x1 >> 2) * 2;
+
+    spi_config_oled();
+    CS_N(0);
+    send_window(x1, y1, x2, y2);
+    send_cmd(0x5C);  // write VRAM command
+
+    // Full rows are consecutive in buf, one transfer is enough
+    t_dma = stat_time(STAT_SEND_FB, t);
+    if (len == stride) {
+        chain_rows = 0;
+        dma_start(buf, len * rows);
+        return;
+    }
+    chain_buf = buf;
+    chain_len = len;
+    chain_stride = stride;
+    chain_rows = rows - 1;
+    dma_start(buf, len);
+}
+
+unsigned ssd1322_clock_reg(void) { return CLOCK_REG; }
+
+uint32_t ssd1322_refresh_us(void) {
+    // 80 Hz were measured with 0x91. The period doubles with each step of the divide ratio
+    // and shrinks with the oscillator frequency, roughly linear around the default setting.
+    const unsigned div = CLOCK_REG & 0xF, fosc = CLOCK_REG >> 4;
+    return (12500u << div) / 2 * 10 / (fosc + 1);
+}
+
+bool ssd1322_busy(void) { return spi_bus_owner() == SPI_DEV_OLED; }
+
+__attribute__((weak)) void ssd1322_done_cb(void) {}
+
+// SPI1_TX DMA transfer complete
+__attribute__((interrupt)) void DMA1_Channel3_IRQHandler(void) {
+    DMA_ClearITPendingBit(DMA1_IT_TC3);
+
+    // Next runs of the init sequence, D/C may change only when the data is out
+    if (seq_p < seq_end) {
+        spi_wait_idle(SPI1);
+        if (seq_step())
+            return;
+    }
+
+    // More rows of a send_rect() transfer to go, keep the bus
+    if (chain_rows > 0) {
+        chain_rows--;
+        chain_buf += chain_stride;
+        dma_start(chain_buf, chain_len);
+        return;
+    }
+    DMA_Cmd(DMA1_Channel3, DISABLE);
+
+    // The last byte has been handed to the SPI but is still being shifted out
+    spi_wait_idle(SPI1);
+
+    // Nobody reads the bytes received during the transfer
+    spi_flush_rx(SPI1);
+
+    spi_release_oled();
+    stat_time(STAT_DMA, t_dma);
+    ssd1322_done_cb();
 }
 
 // x1, y1, x2, y2: the rectangle to update in [pixels]
 // x1, y1, x2 and y2 are all inclusive!
 // note that ssd1322 works with columns of 4 pixels horizontally
 // so the lower 2 bits of x1 and x2 will be truncated
-// data in 4 bits / pixel, 2 pixels / byte
-// void send_window_4(unsigned x1, unsigned y1, unsigned x2, unsigned y2, uint8_t *data) {
-//     // printf("send_window_4(%3d, %3d, %3d, %3d)\n", x1, y1, x2, y2);
-
-//     // truncate the 2 LSBs
-//     x1 >>= 2;
-//     x2 >>= 2;
-
-//     ui_phy_cs_write(SSD1322_CS);
-//     send_cmd(0x15);  // Set column address range
-//     ssd1322_write8(0x1C + x1);
-//     ssd1322_write8(0x1C + x2);
-
-//     send_cmd(0x75);  // Set row address range
-//     ssd1322_write8(y1);
-//     ssd1322_write8(y2);
-
-//     send_cmd(0x5C);  // write VRAM
-//     for (int row = y1; row <= y2; row++) {
-//         uint8_t *p = &data[row * DISPLAY_WIDTH / 2 + x1 * 2];
-//         for (int column = x1; column <= x2; column++) {
-//             // Each column contains 4 pixels = 2 bytes
-//             ssd1322_write8(*p++);
-//             ssd1322_write8(*p++);
-//         }
-//     }
-// }
+void set_window(unsigned x1, unsigned y1, unsigned x2, unsigned y2) {
+    spi_config_oled();
+    CS_N(0);
+    send_window(x1, y1, x2, y2);
+    spi_release_oled();
+}
@@ -2,6 +2,14 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#define DISPLAY_WIDTH 256
+#define DISPLAY_HEIGHT 64
+
+// Rows of the display RAM. The display shows DISPLAY_HEIGHT of them, see set_start_line().
+#define GDDRAM_ROWS 128
+
+// Start sending the init sequence. Returns immediately, the data goes out by DMA and the
+// display is ready when ssd1322_busy() returns false.
 void init_ssd1322(void);
 
 // set OLED brightness (0 = off, 1 - 16 = on)
@@ -10,7 +18,49 @@ void set_brightness(uint8_t val);
 // invert the display
 void set_inverted(bool val);
 
-void send_fb(bool prefix_cmd, unsigned count, uint8_t *buf);
+// Entries of the gamma table, the gray levels of shades 1 - 15 (shade 0 is always off)
+#define GAMMA_LEVELS 15
+
+// Load and enable a custom gamma table of GAMMA_LEVELS pulse widths, ascending, 0 - 180.
+// NULL restores the one of init_ssd1322().
+void set_gamma(const uint8_t *table);
+
+// Scroll in hardware: the top row of the display shows RAM row start (0 - 127), the ones
+// below follow, wrapping around after row 127. offset is the display offset register, a vertical
+// shift of the COM lines by 0 - 127 rows.
+void set_start_line(unsigned start, unsigned offset);
+
+// Stream count bytes of framebuffer data to the display. Optionally prefixed by the
+// write VRAM command. Returns immediately, the data is sent by DMA in the background.
+// buf must stay untouched until ssd1322_busy() returns false.
+void send_fb(bool prefix_cmd, unsigned count, const uint8_t *buf);
+
+// Send the rectangle x1, y1, x2, y2 (inclusive, in [pixels]) out of buf, an image of the
+// whole display with stride bytes per row. Sets the window and returns immediately. Rows which
+// are not consecutive in buf are sent one after the other by the DMA interrupt.
+// x1 and x2 get truncated to multiples of 4, like in set_window().
+void send_rect(unsigned x1,
+               unsigned y1,
+               unsigned x2,
+               unsigned y2,
+               const uint8_t *buf,
+               unsigned stride);
+
+// Value of the clock register (0xB3) set by init_ssd1322()
+unsigned ssd1322_clock_reg(void);
+
+// Estimated refresh period of the panel in [us], derived from the clock register.
+// There is no tearing signal, so neither the exact period nor the phase are known.
+uint32_t ssd1322_refresh_us(void);
+
+// true while the display uses SPI1, e.g. during a send_fb() transfer.
+// SPI1 must not be touched in that case.
+bool ssd1322_busy(void);
+
+// Called from the DMA interrupt when a send_fb() transfer is complete. Weak, override it.
+void ssd1322_done_cb(void);
 
-// send a certain rectangular window of the framebuffer to the display
-// void send_window_4(unsigned x1, unsigned y1, unsigned x2, unsigned y2, uint8_t *data);
+// Restrict the following send_fb() data to a rectangular window of the display.
+// Coordinates are inclusive and in [pixels], y in RAM rows (0 - 127). x1 and x2 get truncated
+// to multiples of 4, the data fills the window row by row, with 4 bits / pixel, 2 pixels / byte.
+void set_window(unsigned x1, unsigned y1, unsigned x2, unsigned y2);
@@ -0,0 +1,46 @@
+#include "stats.h"
+#include "ch32v20x.h"
+#include "timebase.h"
+#include <string.h>
+
+static uint32_t t_reset = 0;  // start of the measurement period [ms]
+static volatile uint32_t counts[CNT_N];
+
+static struct {
+    uint32_t n, min, max;
+    uint64_t sum;
+} timings[STAT_N];
+
+uint32_t stat_time(unsigned id, uint32_t t_start) {
+    const uint32_t now = cycles();
+    const uint32_t dt = now - t_start;
+    if (timings[id].n == 0 || timings[id].min > dt)
+        timings[id].min = dt;
+    if (timings[id].max < dt)
+        timings[id].max = dt;
+    timings[id].sum += dt;
+    timings[id].n++;
+    return now;
+}
+
+void stat_count(unsigned id, uint32_t n) { counts[id] += n; }
+
+void stats_read(stats_t *out, bool reset) {
+    // The DMA interrupt records transfer times
+    NVIC_DisableIRQ(DMA1_Channel3_IRQn);
+    out->t_ms = millis() - t_reset;
+    for (unsigned i = 0; i < CNT_N; i++)
+        out->count[i] = counts[i];
+    for (unsigned i = 0; i < STAT_N; i++) {
+        out->timing[i].n = timings[i].n;
+        out->timing[i].min = timings[i].min;
+        out->timing[i].max = timings[i].max;
+        out->timing[i].avg = (timings[i].n > 0) ? timings[i].sum / timings[i].n : 0;
+    }
+    if (reset) {
+        memset((void *)counts, 0, sizeof(counts));
+        memset(timings, 0, sizeof(timings));
+        t_reset = millis();
+    }
+    NVIC_EnableIRQ(DMA1_Channel3_IRQn);
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Performance counters, read by the host with CMD_STATS
+
+// Timed sections
+enum {
+    STAT_TUD,      // tud_task()
+    STAT_VENDOR,   // vendor_task()
+    STAT_UI_POLL,  // ui_board_poll()
+    STAT_SEND_FB,  // send_fb() / send_rect(), without the DMA transfer
+    STAT_DMA,      // DMA transfers to the display, from start to completion
+    STAT_WORK,     // work_task()
+    STAT_IDLE,     // sleeping in the scheduler, waiting for an interrupt
+    STAT_N
+};
+
+// Event counters
+enum {
+    CNT_LOOPS,        // scheduler passes
+    CNT_RX_BYTES,     // bytes read from the bulk endpoint
+    CNT_FRAMES,       // completed frames, see frame_done of the input report
+    CNT_OVERFLOWS,    // frames / windows which got more pixels than fit
+    CNT_SYNC_RESETS,  // raw mode: new frame started after the quiet period
+    CNT_DROPPED,      // raw mode: ... while the previous one was incomplete
+    CNT_RX_PASSES,    // vendor_task() calls which read bulk data, see CNT_RX_BYTES for the average
+    CNT_RX_FULL,      // ... which found the USB FIFO full, the host was waiting for the firmware
+    CNT_N
+};
+
+typedef struct __attribute__((packed)) {
+    uint32_t n;    // number of measurements
+    uint32_t min;  // [clock-cycles]
+    uint32_t max;
+    uint32_t avg;
+} stat_timing_t;
+
+// Reply to CMD_STATS
+typedef struct __attribute__((packed)) {
+    uint32_t t_ms;  // length of the measurement period
+    uint32_t count[CNT_N];
+    stat_timing_t timing[STAT_N];
+} stats_t;
+
+// Record that section id took from t_start until now [clock-cycles]. Returns now, so calls
+// can be chained. Safe to call from interrupts.
+uint32_t stat_time(unsigned id, uint32_t t_start);
+
+// Add n to counter id
+void stat_count(unsigned id, uint32_t n);
+
+// Copy the counters into out. If reset is true, start a new measurement period.
+void stats_read(stats_t *out, bool reset);
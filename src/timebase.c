@@ -0,0 +1,61 @@
+#include "timebase.h"
+#include "ch32v20x.h"
+#include <assert.h>
+
+// SysTick period of 1 ms
+#define CYCLES_PER_TICK (CYCLES_PER_US * 1000)
+
+volatile uint32_t system_ticks = 0;
+
+__attribute__((interrupt)) void SysTick_Handler(void) {
+    SysTick->SR = 0;
+    system_ticks++;
+}
+
+static void SysTick_Config(uint32_t ticks) {
+    NVIC_EnableIRQ(SysTicK_IRQn);
+    SysTick->CTLR = 0;
+    SysTick->SR = 0;
+    SysTick->CNT = 0;
+    SysTick->CMP = ticks - 1;
+    SysTick->CTLR = 0xF;
+}
+
+void timebase_init(void) {
+    // the conversions are done with the constant
+    assert(SystemCoreClock == CYCLES_PER_US * 1000000);
+    SysTick_Config(CYCLES_PER_TICK);
+}
+
+unsigned millis(void) { return system_ticks; }
+
+// Consistent snapshot of the ms tick and the SysTick counter within that tick
+static void systick_read(uint32_t *ticks, uint32_t *cnt) {
+    uint32_t t, c, wrapped;
+    // retry if the SysTick interrupt ran or the counter wrapped around in the meantime
+    do {
+        t = system_ticks;
+        wrapped = SysTick->SR & 1;
+        c = SysTick->CNT;
+    } while (t != system_ticks || wrapped != (SysTick->SR & 1));
+
+    // The counter wrapped around but the SysTick interrupt could not run yet,
+    // as we are called from another interrupt handler
+    if (wrapped)
+        t++;
+
+    *ticks = t;
+    *cnt = c;
+}
+
+uint32_t cycles(void) {
+    uint32_t t, cnt;
+    systick_read(&t, &cnt);
+    return t * CYCLES_PER_TICK + cnt;
+}
+
+uint32_t micros(void) {
+    uint32_t t, cnt;
+    systick_read(&t, &cnt);
+    return t * 1000 + cnt / CYCLES_PER_US;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Time since boot, all derived from the SysTick counter, which runs at the CPU clock and
+// interrupts once per ms. All of them wrap around, so compare times by subtracting:
+// (now - t_start) >= duration.
+
+// CPU clock in [MHz], timebase_init() checks it against SystemCoreClock
+#define CYCLES_PER_US 144
+
+// Start the SysTick. Call this once, before anything else needs the time.
+void timebase_init(void);
+
+// Milliseconds since boot, wraps around after ~49 days
+unsigned millis(void);
+
+// CPU clock cycles since boot, wraps around after ~30 s. Safe to call from interrupts.
+uint32_t cycles(void);
+
+// Microseconds since boot, wraps around after ~71 minutes. Safe to call from interrupts.
+uint32_t micros(void);
+
+// Timeout, for state machines which check it each time they are called. Nothing may block the
+// main loop.
+typedef struct {
+    uint32_t t_start;   // micros() when started
+    uint32_t duration;  // [us]
+} timeout_t;
+
+// (Re-)start the timeout, expiring duration_us (up to ~35 minutes) from now
+static inline void timeout_start(timeout_t *to, uint32_t duration_us) {
+    to->t_start = micros();
+    to->duration = duration_us;
+}
+
+static inline bool timeout_expired(const timeout_t *to) {
+    return micros() - to->t_start >= to->duration;
+}
+
+// Microseconds since t_start, a value returned by micros()
+static inline uint32_t us_since(uint32_t t_start) { return micros() - t_start; }
+
+// micros() at time t, a value returned by cycles() within the last ~30 s
+static inline uint32_t cycles_to_micros(uint32_t t) {
+    return micros() - (cycles() - t) / CYCLES_PER_US;
+}
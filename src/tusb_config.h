@@ -11,4 +11,8 @@
 // Class Config
 #define CFG_TUD_VENDOR 1
 
+// Bulk OUT FIFO, 16 packets of 64 bytes. The endpoint keeps receiving while vendor_task() is busy,
+// and vendor_task() reads up to this much in one call. Full speed bulk packets stay at 64 bytes.
+#define CFG_TUD_VENDOR_RX_BUFSIZE 1024
+
 #endif
@@ -1,13 +1,20 @@
 #include "ui_board.h"
+#include "ch32v20x_exti.h"
 #include "ch32v20x_spi.h"
+#include "fastio.h"
 #include "main.h"
+#include "spi_bus.h"
 #include "ssd1322.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/param.h>
 
 // Min. duration for a long press in [clock-cycles]
 #define T_LONG 50000000
 
+// Edges of a button closer than this to the previous one are ignored [clock-cycles]
+#define T_DEBOUNCE 1440000  // 10 ms
+
 // Bit 1, 2 and 3 of MCP23_OPCODE_W encode the hardware address (strapping pins)
 #define MCP23_OPCODE_W 0x40
 #define MCP23_OPCODE_R (MCP23_OPCODE_W | 1)
@@ -35,77 +42,186 @@
 #define ODR (1 << 2)     // Open drain interrupt pin
 #define INTPOL (1 << 1)  // active high interrupt pin
 
+// Max. number of steps a single detent can be accelerated to
+#define ACCEL_MAX 64
+
 // encoder and button state. Need to disable the interrupt before writing these
 static volatile int enc_sum = 0;
-static volatile uint16_t gpio_state = 0;
-static unsigned button_flags = 0;
+static volatile int enc_accel_sum = 0;  // same as enc_sum, but with acceleration applied
+static volatile uint16_t gpio_state = IO_ENC_SW | IO_BACK_SW;  // buttons released
+// the interrupt handler found the SPI bus busy and left the MCP23 read for later
+static volatile bool mcp_pending = false;
+static volatile uint32_t t_pending = 0;  // when it fired [clock-cycles]
+static volatile unsigned button_flags = 0;
 static unsigned output_value = 0, output_value_new = 0;
 
-static void spi_config_mcp(void) {
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
-    SPI_NSSInternalSoftwareConfig(SPI1, SPI_NSS_Hard);
-    SPI_DataSizeConfig(SPI1, SPI_DataSize_16b);
+// Single producer (the EXTI handler, or main with EXTI disabled), single consumer (main)
+// ring buffer of input events. The free running indices are only written by one side each.
+#define EV_QUEUE_LEN 64  // must be a power of 2
+static ui_event_t ev_queue[EV_QUEUE_LEN];
+static volatile unsigned ev_wr = 0, ev_rd = 0;
+static volatile unsigned ev_lost = 0;
+
+// t: when the MCP23 sample causing the event was taken [clock-cycles]
+static void ev_push(uint32_t t, uint8_t type, unsigned flags, int delta) {
+    if (ev_wr - ev_rd >= EV_QUEUE_LEN) {
+        ev_lost++;
+        return;
+    }
+    ui_event_t *e = &ev_queue[ev_wr % EV_QUEUE_LEN];
+    e->t_us = cycles_to_micros(t);
+    e->type = type;
+    e->flags = flags;
+    e->delta = delta;
+    // make sure the event is complete before the consumer can see it
+    __sync_synchronize();
+    ev_wr++;
+}
+
+unsigned get_events(ui_event_t *out, unsigned max_n) {
+    unsigned n = 0;
+    while (n < max_n && ev_rd != ev_wr) {
+        out[n++] = ev_queue[ev_rd % EV_QUEUE_LEN];
+        // done reading the slot before handing it back to the producer
+        __sync_synchronize();
+        ev_rd++;
+    }
+    return n;
 }
 
+unsigned get_events_lost(void) {
+    NVIC_DisableIRQ(EXTI0_IRQn);
+    unsigned ret = ev_lost;
+    ev_lost = 0;
+    NVIC_EnableIRQ(EXTI0_IRQn);
+    return ret;
+}
+
+// Steps of ui_init_step()
+static enum {
+    INIT_IDLE,
+    INIT_RESET,     // RES_N is low
+    INIT_RELEASE,   // RES_N is high, the chips are waking up
+    INIT_MCP,       // waiting for the bus to set up the MCP23
+    INIT_OLED,      // waiting for the bus to send the OLED init table
+    INIT_OLED_SEQ,  // the init table is going out by DMA
+} init_state = INIT_IDLE;
+static timeout_t init_timeout;  // of the RES_N pulse and the wake-up time
+
 // Write a 16 bit register-pair (suffix _A and _B)
 static void mcp23_write16(uint8_t addr, uint16_t val) {
     // value will be sent MSB-first
-    SPI_I2S_SendData(SPI1, (MCP23_OPCODE_W << 8) | addr);
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
-    SPI_I2S_SendData(SPI1, val);
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
+    spi_put(SPI1, (MCP23_OPCODE_W << 8) | addr);
+    spi_put(SPI1, val);
+    spi_wait_idle(SPI1);
 }
 
 // Write a 8 bit register
 static void mcp23_write8(uint8_t addr, uint8_t val) {
     SPI_DataSizeConfig(SPI1, SPI_DataSize_8b);
 
-    SPI_I2S_SendData(SPI1, MCP23_OPCODE_W);
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
-    SPI_I2S_SendData(SPI1, addr);
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
-    SPI_I2S_SendData(SPI1, val);
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
+    spi_put(SPI1, MCP23_OPCODE_W);
+    spi_put(SPI1, addr);
+    spi_put(SPI1, val);
+    spi_wait_idle(SPI1);
 
     SPI_DataSizeConfig(SPI1, SPI_DataSize_16b);
 }
 
 // Read a 16 bit register-pair (suffix _A and _B)
 static uint16_t mcp23_read16(uint8_t addr) {
-    SPI_I2S_SendData(SPI1, (MCP23_OPCODE_R << 8) | addr);
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
-
-    SPI_I2S_SendData(SPI1, 0);
-    while (SPI_I2S_GetFlagStatus(SPI1, SPI_I2S_FLAG_BSY))
-        ;
-
-    return SPI_I2S_ReceiveData(SPI1);
+    // drop what was clocked in by earlier writes
+    spi_flush_rx(SPI1);
+    // reading the word clocked in during the opcode makes room for the data word
+    spi_xfer(SPI1, (MCP23_OPCODE_R << 8) | addr);
+    const uint16_t val = spi_xfer(SPI1, 0);
+    spi_wait_idle(SPI1);
+    return val;
 }
 
 // 4 bit lookup table for Gray-code transitions
 static const int8_t enc_table[16] = {0, -1, 1, 0, 1, 0, 0, -1, -1, 0, 0, 1, 0, 1, -1, 0};
 
-void ui_board_poll() {
-    if (output_value_new != output_value) {
-        spi_config_mcp();
-        mcp23_write16(MCP23_OLAT, output_value_new);
-        output_value = output_value_new;
+// Buttons pull their input low when pressed
+typedef struct {
+    uint16_t io;        // input pin
+    unsigned state;     // BTN_* flag
+    unsigned ev_short;  // EV_*_S flag
+    unsigned ev_long;   // EV_*_L flag
+    bool pressed;       // debounced state
+    bool long_sent;     // the long press event has been raised for the current press
+    uint32_t t_edge;    // time of the last accepted edge [clock-cycles]
+} button_t;
+
+static button_t buttons[] = {
+    {.io = IO_ENC_SW, .state = BTN_ENC, .ev_short = EV_ENC_S, .ev_long = EV_ENC_L},
+    {.io = IO_BACK_SW, .state = BTN_BACK, .ev_short = EV_BACK_S, .ev_long = EV_BACK_L},
+};
+
+// Debounce the buttons and detect short and long presses.
+// val is the MCP23 pin state, t the time it was sampled.
+static void buttons_update(unsigned val, uint32_t t) {
+    for (unsigned i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++) {
+        button_t *b = &buttons[i];
+        const bool pressed = !(val & b->io);
+        const uint32_t dt = t - b->t_edge;
+
+        if (pressed != b->pressed && dt >= T_DEBOUNCE) {
+            b->pressed = pressed;
+            b->t_edge = t;
+            unsigned ev = 0;
+            if (pressed) {
+                b->long_sent = false;
+                button_flags |= b->state;
+            } else {
+                if (!b->long_sent)
+                    ev = (dt >= T_LONG) ? b->ev_long : b->ev_short;
+                button_flags = (button_flags | ev) & ~b->state;
+            }
+            ev_push(t, EVT_BTN, (button_flags & (BTN_ENC | BTN_BACK)) | ev, 0);
+        } else if (b->pressed && !b->long_sent && dt >= T_LONG) {
+            // Still held down, no need to wait for the release
+            b->long_sent = true;
+            button_flags |= b->ev_long;
+            ev_push(t, EVT_BTN, (button_flags & (BTN_ENC | BTN_BACK)) | b->ev_long, 0);
+        }
     }
+}
 
-    // Skip reading IO state if the INT_ON_CHANGE pin is low (no change)
-    if (!GPIO_ReadInputDataBit(GPIOA, PIN_INT_IO))
-        return;
+// Encoder acceleration curve, see set_encoder_accel()
+static unsigned accel_v0 = 0, accel_gain = 0;
+
+// Apply the acceleration curve to a detent in direction dir (+-1), sampled at t [clock-cycles]
+static void enc_accelerate(int dir, uint32_t t) {
+    static uint32_t t_last = 0;
+    static int dir_last = 0;
+    static unsigned frac = 0;  // fractional steps [1/256]
+
+    // cycles() wraps around too soon for slow turning
+    const uint32_t t_us = cycles_to_micros(t);
+    const uint32_t dt = t_us - t_last;
+    t_last = t_us;
+
+    // [1 / 256 steps] for this detent, no acceleration when changing direction
+    unsigned steps = 256;
+    if (accel_gain > 0 && dir == dir_last && dt > 0) {
+        const uint32_t v = 1000000 / dt;  // [detents / s]
+        // 64 bit, samples decoded back to back give a tiny dt
+        if (v > accel_v0)
+            steps += MIN((uint64_t)accel_gain * (v - accel_v0), (ACCEL_MAX - 1) * 256);
+    }
+    if (dir != dir_last)
+        frac = 0;
+    dir_last = dir;
+
+    frac += steps;
+    enc_accel_sum += dir * (int)(frac >> 8);
+    frac &= 0xFF;
+}
 
-    // Read the MCP23 IO pin state
-    spi_config_mcp();
-    const unsigned val = mcp23_read16(MCP23_GPIO);
+// Process a sample of the MCP23 IO pin state, taken at time t [clock-cycles]
+static void ui_update(unsigned val, uint32_t t) {
+    buttons_update(val, t);
 
     // # Rotary encoder
     static int8_t enc_acc = 0, enc_d = 0;
@@ -123,55 +239,231 @@ void ui_board_poll() {
     // 0b00 is always a unstable state (on a detent)
     // Only check the accumulator when in a stable state
     if (enc != 0) {
-        if (enc_acc >= 2)
+        if (enc_acc >= 2) {
             enc_sum++;
-        if (enc_acc <= -2)
+            enc_accelerate(1, t);
+            ev_push(t, EVT_ENC, 0, 1);
+        }
+        if (enc_acc <= -2) {
             enc_sum--;
+            enc_accelerate(-1, t);
+            ev_push(t, EVT_ENC, 0, -1);
+        }
         enc_acc = 0;
     }
     enc_d = enc;
     gpio_state = val;
 }
 
-void ui_init(void) {
-    // # Power ON reset
-    GPIO_ResetBits(GPIOA, PIN_RES_N);
-    delay_ms(1);
-    GPIO_SetBits(GPIOA, PIN_RES_N);
-    delay_ms(1);
+// Read the MCP23 IO pin state. Only call this while holding the SPI bus, with the
+// interrupt disabled (or from within the interrupt handler).
+static void mcp_sample(void) {
+    // INTCAP holds the state of when the interrupt fired, not of when we got the bus
+    const uint32_t t = mcp_pending ? t_pending : cycles();
+    mcp_pending = false;
+    // The pin state captured when the interrupt fired (after the first change) ...
+    ui_update(mcp23_read16(MCP23_INTCAP), t);
+    // ... and the state right now. Reading GPIO clears the interrupt.
+    ui_update(mcp23_read16(MCP23_GPIO), cycles());
+}
 
-    // # Init MCP23
-    spi_config_mcp();
-    // A special mode (Byte mode with IOCON.BANK = 0) causes the address pointer
-    // to toggle between associated A/B register pairs.
-    mcp23_write8(MCP23_IOCON, INTPOL | DISSLW | SEQOP | MIRROR);
-    // GPIO direction
-    mcp23_write16(MCP23_IODIR, IO_ENC_A | IO_ENC_B | IO_ENC_SW | IO_BACK_SW | IO_NC);
-    // enable interrupts for switches and encoder
-    mcp23_write16(MCP23_GPINTEN, IO_ENC_A | IO_ENC_B | IO_ENC_SW | IO_BACK_SW);
-    // interrupt on any input change
-    mcp23_write16(MCP23_INTCON, 0);
+// Run the interrupt handler again once the bus is free
+static void mcp_wake(void) { EXTI_GenerateSWInterrupt(EXTI_Line0); }
 
-    set_leda(0);
-    set_ledb(0);
+// The MCP23 signals a change of its inputs on INT_IO
+__attribute__((interrupt)) void EXTI0_IRQHandler(void) {
+    EXTI_ClearITPendingBit(EXTI_Line0);
 
-    // # Init the OLED
-    init_ssd1322();
+    // The OLED is using the bus. It will trigger us again once done.
+    if (!spi_bus_try_acquire(SPI_DEV_MCP, mcp_wake)) {
+        if (!mcp_pending)
+            t_pending = cycles();
+        mcp_pending = true;
+        return;
+    }
+    mcp_sample();
+    spi_bus_release();
+}
+
+void ui_board_poll() {
+    // The MCP23 is in reset
+    if (init_state == INIT_RESET || init_state == INIT_RELEASE)
+        return;
+
+    // Keep the interrupt handler off the bus while we use it
+    NVIC_DisableIRQ(EXTI0_IRQn);
+
+    // The OLED is streaming framebuffer data, try again later
+    if (!spi_bus_try_acquire(SPI_DEV_MCP, NULL)) {
+        NVIC_EnableIRQ(EXTI0_IRQn);
+        return;
+    }
+
+    if (output_value_new != output_value) {
+        mcp23_write16(MCP23_OLAT, output_value_new);
+        output_value = output_value_new;
+    }
+
+    // Normally the interrupt handler takes care of reading the inputs. Catch up in case
+    // it had to leave that for later or if we missed an edge of INT_IO.
+    if (mcp_pending || gpio_read(GPIOA, PIN_INT_IO))
+        mcp_sample();
+
+    // Time based button events need no new sample: long presses and edges ignored
+    // by the debouncer which turned out to be real
+    buttons_update(gpio_state, cycles());
+
+    spi_bus_release();
+    NVIC_EnableIRQ(EXTI0_IRQn);
+}
+
+bool ui_board_pending(void) {
+    if (init_state == INIT_RESET || init_state == INIT_RELEASE)
+        return false;
+    if (mcp_pending || output_value_new != output_value || gpio_read(GPIOA, PIN_INT_IO))
+        return true;
+    // the time based button events of buttons_update()
+    for (unsigned i = 0; i < sizeof(buttons) / sizeof(buttons[0]); i++) {
+        const button_t *b = &buttons[i];
+        if (b->pressed != !(gpio_state & b->io) || (b->pressed && !b->long_sent))
+            return true;
+    }
+    return false;
+}
+
+bool ui_init_step(void) {
+    switch (init_state) {
+    case INIT_IDLE:
+        // Keep the interrupt handler off the MCP23 while it's in reset
+        NVIC_DisableIRQ(EXTI0_IRQn);
+
+        // # Power ON reset
+        GPIO_ResetBits(GPIOA, PIN_RES_N);
+        timeout_start(&init_timeout, 1000);
+        init_state = INIT_RESET;
+        return false;
+
+    case INIT_RESET:
+        if (!timeout_expired(&init_timeout))
+            return false;
+        GPIO_SetBits(GPIOA, PIN_RES_N);
+        timeout_start(&init_timeout, 1000);
+        init_state = INIT_RELEASE;
+        return false;
+
+    case INIT_RELEASE:
+        if (!timeout_expired(&init_timeout))
+            return false;
+        init_state = INIT_MCP;
+        // fall through
+
+    case INIT_MCP:
+        // The OLED is streaming framebuffer data, try again later
+        if (!spi_bus_try_acquire(SPI_DEV_MCP, NULL))
+            return false;
+
+        // # Init MCP23
+        // A special mode (Byte mode with IOCON.BANK = 0) causes the address pointer
+        // to toggle between associated A/B register pairs.
+        mcp23_write8(MCP23_IOCON, INTPOL | DISSLW | SEQOP | MIRROR);
+        // GPIO direction
+        mcp23_write16(MCP23_IODIR, IO_ENC_A | IO_ENC_B | IO_ENC_SW | IO_BACK_SW | IO_NC);
+        // enable interrupts for switches and encoder
+        mcp23_write16(MCP23_GPINTEN, IO_ENC_A | IO_ENC_B | IO_ENC_SW | IO_BACK_SW);
+        // interrupt on any input change
+        mcp23_write16(MCP23_INTCON, 0);
+        // initial input state, also clears a pending interrupt
+        ui_update(mcp23_read16(MCP23_GPIO), cycles());
+        // OLAT after the reset, so ui_board_poll() writes the LED state again
+        output_value = 0;
+        spi_bus_release();
+        NVIC_EnableIRQ(EXTI0_IRQn);
+
+        set_leda(0);
+        set_ledb(0);
+        init_state = INIT_OLED;
+        return false;
+
+    case INIT_OLED:
+        // init_ssd1322() would wait for the bus
+        if (spi_bus_owner() != SPI_DEV_NONE)
+            return false;
+
+        // # Init the OLED
+        init_ssd1322();
+        init_state = INIT_OLED_SEQ;
+        return false;
+
+    case INIT_OLED_SEQ:
+        if (ssd1322_busy())
+            return false;
+        init_state = INIT_IDLE;
+        return true;
+    }
+    return true;
+}
+
+unsigned mcp23_selftest(void) {
+    static const uint16_t patterns[SELFTEST_N] = {
+        0x0000, 0xFFFF, 0x55AA, 0xAA55, 0x0001, 0x8000, 0x00FF, 0xFF00};
+    unsigned n_failed = 0;
+
+    NVIC_DisableIRQ(EXTI0_IRQn);
+    spi_bus_acquire(SPI_DEV_MCP);
+    // DEFVAL is only used with INTCON != 0, so it's free to play with
+    for (unsigned i = 0; i < SELFTEST_N; i++) {
+        mcp23_write16(MCP23_DEFVAL, patterns[i]);
+        if (mcp23_read16(MCP23_DEFVAL) != patterns[i])
+            n_failed++;
+    }
+    mcp23_write16(MCP23_DEFVAL, 0);
+    spi_bus_release();
+    NVIC_EnableIRQ(EXTI0_IRQn);
+
+    return n_failed;
 }
 
 int get_encoder_ticks(bool reset) {
+    NVIC_DisableIRQ(EXTI0_IRQn);
     int ret = enc_sum;
     if (reset)
         enc_sum = 0;
+    NVIC_EnableIRQ(EXTI0_IRQn);
     return ret;
 }
 
+// Remove up to +-limit ticks from an accumulator and return them
+static int take_ticks(volatile int *sum, int limit) {
+    NVIC_DisableIRQ(EXTI0_IRQn);
+    int ret = MAX(MIN(*sum, limit), -limit);
+    *sum -= ret;
+    NVIC_EnableIRQ(EXTI0_IRQn);
+    return ret;
+}
+
+int take_encoder_ticks(int limit) { return take_ticks(&enc_sum, limit); }
+
+int take_encoder_accel(int limit) { return take_ticks(&enc_accel_sum, limit); }
+
+int peek_encoder_accel(void) { return enc_accel_sum; }
+
+void set_encoder_accel(unsigned v0, unsigned gain) {
+    NVIC_DisableIRQ(EXTI0_IRQn);
+    accel_v0 = v0;
+    accel_gain = gain;
+    NVIC_EnableIRQ(EXTI0_IRQn);
+}
+
 unsigned get_button_flags(void) {
+    NVIC_DisableIRQ(EXTI0_IRQn);
     unsigned ret = button_flags;
-    button_flags &= 0x3;  // clear the button-push event flags
+    button_flags &= BTN_ENC | BTN_BACK;  // clear the button-push event flags
+    NVIC_EnableIRQ(EXTI0_IRQn);
     return ret;
 }
 
+unsigned peek_button_flags(void) { return button_flags; }
+
 uint16_t get_gpios(void) { return gpio_state; }
 
 void set_leds(unsigned rgb_value) {
@@ -2,11 +2,15 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+// Button flags indicating the state
+#define BTN_ENC (1 << 0)
+#define BTN_BACK (1 << 1)
+
 // Button flags indicating events
-#define EV_ENC_S (1 << 4)
-#define EV_ENC_L (1 << 8)
-#define EV_BACK_S (1 << 5)
-#define EV_BACK_L (1 << 9)
+#define EV_ENC_S (1 << 2)
+#define EV_BACK_S (1 << 3)
+#define EV_ENC_L (1 << 4)
+#define EV_BACK_L (1 << 5)
 
 // MCP23 pin assignment
 #define IO_NC ((1 << 0) | (1 << 11) | (1 << 12) | (1 << 13) | (1 << 14) | (1 << 15))
@@ -21,28 +25,80 @@
 #define IO_LEDA_G (1 << 9)
 #define IO_LEDA_B (1 << 10)
 
+// Input event types
+#define EVT_ENC 1  // encoder moved by delta steps
+#define EVT_BTN 2  // button state changed or press event, see flags
+
+// Input event, as queued by the interrupt handler
+typedef struct __attribute__((packed)) {
+    uint32_t t_us;  // time of the event in [us], wraps around
+    uint8_t type;   // EVT_*
+    uint8_t flags;  // button state after the event (BTN_*), plus the press event (EV_*) if any
+    int16_t delta;  // encoder steps
+} ui_event_t;
+
 // Mapping of chip-select signals
 #define SSD1322_CS (1 << 0)
 #define MCP23_CS (1 << 1)
 
-// # Call this once to initialize
-void ui_init(void);
+// # Call this to initialize or reset the MCP23 and the OLED. Does one step per call, without
+// blocking, returns true once done. Call it again until then. See work.h.
+bool ui_init_step(void);
 
 // Call in main loop
 void ui_board_poll(void);
 
+// true if ui_board_poll() has something to do: read the inputs, write the LEDs or
+// time a button press
+bool ui_board_pending(void);
+
 // # Call these whenever
 
+// Number of patterns written and read back by mcp23_selftest()
+#define SELFTEST_N 8
+
+// Check the SPI link to the MCP23 by writing test patterns to a register and reading
+// them back. Returns the number of failed readbacks. Blocks until the OLED releases the bus.
+unsigned mcp23_selftest(void);
+
 // if reset is true, returns number of encoder ticks (and direction) since last call
 // if reset is false, returns accumulated encoder ticks
 int get_encoder_ticks(bool reset);
 
+// returns the accumulated encoder ticks, clamped to +-limit, and removes them from the
+// accumulator. What does not fit is returned by the next call.
+int take_encoder_ticks(int limit);
+
+// same as take_encoder_ticks(), but with the acceleration curve applied
+int take_encoder_accel(int limit);
+
+// returns the accumulated accelerated ticks, without removing them
+int peek_encoder_accel(void);
+
+// Configure the encoder acceleration curve. When turned faster than v0 [detents / s],
+// each detent counts as 1 + gain * (speed - v0) / 256 accelerated steps (up to 64).
+// Fractions are carried over to the next detent. gain = 0 disables acceleration.
+void set_encoder_accel(unsigned v0, unsigned gain);
+
+// Copy up to max_n queued input events into out, oldest first. Returns the number copied.
+// Events are timestamped in the interrupt handler, so their timing is exact even if
+// they are read much later.
+unsigned get_events(ui_event_t *out, unsigned max_n);
+
+// returns the number of events dropped because the queue was full and resets it
+unsigned get_events_lost(void);
+
 // returns flags indicating instantaneous state (in the 2 LSBs) and short and long press
 // events of the encoder and back-button:
 // {back_long_press, enc_long_press, back_short_press, enc_short_press, back, enc},
 // the press-events get cleared automatically on returning from this function.
+// A long press event is raised as soon as the button has been held for T_LONG,
+// a short press event when it is released before that.
 unsigned get_button_flags(void);
 
+// same as get_button_flags(), without clearing the press events
+unsigned peek_button_flags(void);
+
 // # Set the LED status, bits of rgb_value are {B, G, R}
 void set_leda(unsigned rgb_value);
 void set_ledb(unsigned rgb_value);
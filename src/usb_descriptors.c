@@ -8,9 +8,16 @@
 
 // Endpoint Addresses
 #define EPNUM_OUT 0x01  // Host -> Device (Bulk, LEDs + Display)
+#define EPNUM_IN 0x81   // Device -> Host (Interrupt, input reports)
 
-// Total length: Config + Interface + Bulk endpoint
-#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + 9 + 7)
+// Polling interval of the interrupt endpoint in [ms]. 1 ms is the fastest on full speed.
+// Reports are only sent when an input changed, so a short interval costs no bandwidth.
+#ifndef EP_IN_INTERVAL_MS
+#define EP_IN_INTERVAL_MS 1
+#endif
+
+// Total length: Config + Interface + Bulk endpoint + Interrupt endpoint
+#define CONFIG_TOTAL_LEN (TUD_CONFIG_DESC_LEN + 9 + 7 + 7)
 
 //--------------------------------------------------------------------+
 // Device Descriptors
@@ -56,7 +63,11 @@ uint8_t const desc_configuration[] =
 
     // 3. Endpoint Descriptor (OUT - Bulk - for Display)
     // bLength, bDescriptorType, bEndpointAddress, bmAttributes, wMaxPacketSize, bInterval
-    7, TUSB_DESC_ENDPOINT, EPNUM_OUT, TUSB_XFER_BULK, 64, 0,
+    7, TUSB_DESC_ENDPOINT, EPNUM_OUT, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
+
+    // 4. Endpoint Descriptor (IN - Interrupt - for input reports)
+    // bLength, bDescriptorType, bEndpointAddress, bmAttributes, wMaxPacketSize, bInterval
+    7, TUSB_DESC_ENDPOINT, EPNUM_IN, TUSB_XFER_INTERRUPT, U16_TO_U8S_LE(16), EP_IN_INTERVAL_MS,
 };
 // clang-format on
 
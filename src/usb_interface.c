@@ -1,10 +1,15 @@
 #include "ch32v20x.h"
 #include "ch32v20x_gpio.h"
 #include "ch32v20x_spi.h"
+#include "font.h"
+#include "framebuffer.h"
 #include "main.h"
+#include "spi_bus.h"
 #include "ssd1322.h"
+#include "stats.h"
 #include "tusb.h"
 #include "ui_board.h"
+#include "work.h"
 #include <stdint.h>
 #include <string.h>
 #include <sys/param.h>
@@ -13,35 +18,645 @@
 typedef struct __attribute__((packed)) {
     uint8_t button_flags;  // Bit 0: Btn1, Bit 1: Btn2
     int8_t encoder_delta;  // Relative delta since last send
+    int8_t encoder_accel;  // Same, with the acceleration curve applied
+    // Presentation status, see CMD_OLED_VSYNC. Only in reports on the interrupt endpoint.
+    uint8_t frame_flags;  // FRAME_DONE: a frame has been completed since the last report
+    uint8_t clock_reg;    // display clock register (0xB3)
+    uint16_t frame_seq;   // seq of the last completed message, frame counter in raw mode
+    uint32_t frame_t_us;  // when it was completed, micros()
+    uint32_t refresh_us;  // estimated refresh period of the panel
 } input_packet_t;
 
+#define FRAME_DONE (1 << 0)
+
+// Reply to CMD_SPI_CLOCK
+typedef struct __attribute__((packed)) {
+    uint8_t n_tests;   // number of MCP23 register readbacks
+    uint8_t n_failed;  // how many of them returned the wrong value
+} selftest_packet_t;
+
+static selftest_packet_t selftest;
+
+// Reply to CMD_STATS
+static stats_t stats;
+
+// Reply to CMD_EVENTS
+#define MAX_EVENTS 32
+typedef struct __attribute__((packed)) {
+    uint16_t n;     // number of events
+    uint16_t lost;  // events dropped since the last read as the queue was full
+    ui_event_t ev[MAX_EVENTS];
+} events_packet_t;
+
+// must stay valid until the control transfer is done
+static events_packet_t events;
+
 #define FRAME_SIZE 8192
 
 // If no new USB frames are received for this amount of time, start a fresh
 // frame Short enough to fit in the inter-frame gap, long enough to cover USB
 // jitter
-#define SYNC_TIMEOUT_MS 4
+#define SYNC_TIMEOUT_US 4000
+
+// Size of one staging buffer. USB data is collected in one of them while the
+// other one is sent to the OLED by DMA.
+#define STAGE_SIZE 512
+
+// Format of the bulk data, selected with CMD_OLED_MODE
+enum {
+    FB_MODE_RAW = 0,       // complete 8192 byte framebuffers, separated by a quiet period
+    FB_MODE_PACKET = 1,    // messages, each starting with a msg_hdr_t
+    FB_MODE_BUFFERED = 2,  // same as FB_MODE_PACKET, but drawn into the device framebuffer
+};
+
+// Header of a message in FB_MODE_PACKET
+#define MSG_MAGIC 0xA5
+typedef struct __attribute__((packed)) {
+    uint8_t magic;  // MSG_MAGIC
+    uint8_t type;   // one of MSG_*
+    uint16_t seq;   // sequence number, incremented by the host for each message
+    uint16_t len;   // number of payload bytes following the header
+} msg_hdr_t;
+
+// Message types
+enum {
+    MSG_FRAME = 0x01,   // a complete framebuffer of 8192 bytes
+    MSG_WINDOW = 0x02,  // window {x1, y1, x2, y2} in [pixels], followed by its pixels
+    MSG_WINDOW_RLE = 0x03,  // window {x1, y1, x2, y2}, followed by its PackBits compressed pixels
+    MSG_DRAW = 0x04,        // drawing operations, see fb_draw(). FB_MODE_BUFFERED only.
+    MSG_FONT = 0x05,        // glyph cache upload, see font.h
+    MSG_SCROLL = 0x06,      // {start, offset}, see set_start_line(). FB_MODE_PACKET only.
+};
+
+// Command IDs
+enum {
+    CMD_RESET = 0x10,
+    CMD_VERSION = 0x11,
+    CMD_STATS = 0x12,
+    CMD_SPI_CLOCK = 0x13,
+    CMD_BATCH = 0x14,
+    CMD_BTNS_ENC = 0x20,
+    CMD_IO_LEDS = 0x21,
+    CMD_EVENTS = 0x22,
+    CMD_ENC_ACCEL = 0x23,
+    // CMD_IO_AUX_OE = 0x28,
+    // CMD_IO_AUX_OL = 0x29,
+    CMD_OLED_FLUSH = 0x30,
+    CMD_OLED_BRIGHTNESS = 0x31,
+    CMD_OLED_INVERTED = 0x32,
+    CMD_OLED_MODE = 0x33,
+    CMD_OLED_FB_RATE = 0x34,
+    CMD_OLED_SCROLL = 0x35,
+    CMD_OLED_VSYNC = 0x36,
+    CMD_OLED_DEPTH = 0x37,
+    CMD_OLED_GAMMA = 0x38,
+};
+
+// Max. size of a MSG_DRAW message, bigger ones are skipped
+#define DRAW_BUF_SIZE 512
+
+static unsigned fb_mode = FB_MODE_RAW;
+static volatile bool flush_request = false;
+
+// CMD_OLED_VSYNC flags
+#define VSYNC_REPORT (1 << 0)  // send a report when a frame is complete
+#define VSYNC_PACE (1 << 1)    // FB_MODE_BUFFERED: flush on the estimated refresh boundaries
+static unsigned vsync_flags = 0;
+
+// Frame completion, for the input reports
+static uint16_t msg_seq = 0;        // seq of the latest message processed
+static bool frame_pending = false;  // its pixels have been received, but are not on the display yet
+static bool frame_done = false;     // completed a frame since the last report
+static uint16_t frame_seq = 0;
+static uint32_t frame_t_us = 0;
+
+static void frame_complete(void) {
+    stat_count(CNT_FRAMES, 1);
+    frame_seq = msg_seq;
+    frame_t_us = micros();
+    frame_done = true;
+}
+
+// CMD_OLED_SCROLL, applied between windows. Not ordered with the bulk data, see MSG_SCROLL.
+static volatile bool scroll_request = false;
+static unsigned scroll_start = 0, scroll_offset = 0;
+
+// CMD_OLED_GAMMA, applied between windows like the scrolling
+static volatile bool gamma_request = false;
+static bool gamma_custom = false;  // gamma_table is valid, else the default
+static uint8_t gamma_table[GAMMA_LEVELS];
+static uint8_t gamma_rx[GAMMA_LEVELS];  // data stage, copied once validated
+
+// CMD_OLED_DEPTH: bits / pixel of the uncompressed pixel data (1, 2 or 4). Less than 4 get
+// expanded through the palette into the 4 bit stream of the display.
+// A new depth is taken over by rx_reset(), so the data of the old format isn't decoded with it.
+static unsigned depth = 4;
+static unsigned depth_new = 0;  // requested depth, 0 = none
+static uint8_t palette[16];     // shade of each pixel value, of depth_new if set
+static uint8_t palette_rx[16];  // data stage of CMD_OLED_DEPTH
+// The 2 display bytes of 4 pixels, indexed by one input byte (depth 2) or nibble (depth 1)
+static uint8_t depth_lut[256][2];
+
+// Request a new depth, the palette is pal or spread evenly if NULL
+static void depth_request(unsigned bits, const uint8_t *pal) {
+    const unsigned mask = (1u << bits) - 1;
+    for (unsigned i = 0; i <= mask; i++)
+        palette[i] = (pal != NULL) ? pal[i] : i * 15 / mask;
+    depth_new = bits;
+}
+
+// Switch over to the requested depth
+static void depth_apply(void) {
+    const unsigned bits = depth_new, mask = (1u << bits) - 1;
+    depth = bits;
+    depth_new = 0;
+    if (bits == 4)
+        return;
+    for (unsigned i = 0; i < 1u << (4 * bits); i++) {
+        uint8_t px[4];
+        // first pixel in the MSBs
+        for (unsigned k = 0; k < 4; k++)
+            px[k] = palette[(i >> ((3 - k) * bits)) & mask];
+        depth_lut[i][0] = px[0] << 4 | px[1];
+        depth_lut[i][1] = px[2] << 4 | px[3];
+    }
+}
+
+// Bytes on the bus for n bytes of 4 bit pixel data, rounded up to full bytes
+static unsigned packed_size(unsigned n) { return (n * depth + 3) / 4; }
+
+// CMD_BATCH: commands {cmd, len, value[len]}, applied between windows by vendor_task()
+#define BATCH_SIZE 256
+static uint8_t batch_buf[BATCH_SIZE];
+static unsigned batch_len = 0;  // valid bytes in batch_buf
+static bool batch_rx = false;   // receiving the data stage of a CMD_BATCH into batch_buf
+
+// Commands which can be batched
+static bool batchable(unsigned cmd) {
+    switch (cmd) {
+    case CMD_IO_LEDS:
+    case CMD_ENC_ACCEL:
+    case CMD_OLED_BRIGHTNESS:
+    case CMD_OLED_INVERTED:
+    case CMD_OLED_FB_RATE:
+    case CMD_OLED_VSYNC:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// value and index like wValue and wIndex of the control request
+static void apply_cmd(unsigned cmd, unsigned value, unsigned index) {
+    switch (cmd) {
+    case CMD_IO_LEDS:
+        set_leds(value);
+        break;
+    case CMD_ENC_ACCEL:
+        set_encoder_accel(value, index);
+        break;
+    case CMD_OLED_BRIGHTNESS:
+        set_brightness(MIN(value, 16));
+        break;
+    case CMD_OLED_INVERTED:
+        set_inverted(value);
+        break;
+    case CMD_OLED_FB_RATE:
+        fb_set_interval(value);
+        break;
+    case CMD_OLED_VSYNC:
+        vsync_flags = value;
+        fb_set_vsync((vsync_flags & VSYNC_PACE) ? ssd1322_refresh_us() : 0);
+        break;
+    }
+}
+
+// Queue a single command behind the batched ones
+static bool batch_push(unsigned cmd, unsigned value, unsigned index) {
+    if (batch_rx || batch_len + 6 > BATCH_SIZE)
+        return false;
+    uint8_t *p = batch_buf + batch_len;
+    p[0] = cmd;
+    p[1] = 4;
+    p[2] = value;
+    p[3] = value >> 8;
+    p[4] = index;
+    p[5] = index >> 8;
+    batch_len += 6;
+    return true;
+}
+
+// Run all commands of buf, or only check them if apply is false. Returns false if one is invalid.
+static bool batch_run(const uint8_t *buf, unsigned len, bool apply) {
+    const uint8_t *p = buf, *end = buf + len;
+    while (p < end) {
+        if (end - p < 2 || p[1] > 4 || (unsigned)(end - p) < 2u + p[1] || !batchable(p[0]))
+            return false;
+        // missing value bytes are 0, little endian
+        uint8_t v[4] = {0};
+        memcpy(v, p + 2, p[1]);
+        if (apply)
+            apply_cmd(p[0], v[0] | v[1] << 8, v[2] | v[3] << 8);
+        p += 2 + p[1];
+    }
+    return true;
+}
 
 static unsigned byte_index = 0;
-static unsigned last_packet_time = 0;
+static bool rx_overflow = false;  // got more pixels than fit into the current window
+static unsigned frame_size = 0;  // number of pixel bytes expected in the current transfer
+static uint32_t last_packet_time = 0;  // micros()
 
-void vendor_task(void) {
-    if (!tud_vendor_mounted())
+// Receiver state
+static enum {
+    RX_SYNC,    // waiting for the start of a raw frame
+    RX_HEADER,  // waiting for a message header
+    RX_WINDOW,  // waiting for the window coordinates
+    RX_SETUP,   // waiting for the display to become ready for a new window
+    RX_PIXELS,  // receiving pixel data
+    RX_SKIP,    // discarding the rest of a message
+    RX_BLOCK,   // receiving a message which is processed once complete
+    RX_SCROLL,  // MSG_SCROLL waiting for the pixels before it to be in the display RAM
+} rx_state = RX_SYNC;
+
+static msg_hdr_t hdr;
+static unsigned hdr_fill = 0;
+static unsigned msg_left = 0;  // payload bytes of the current message not yet read
+
+// MSG_DRAW payload, executed once complete
+static uint8_t draw_buf[DRAW_BUF_SIZE];
+
+// MSG_SCROLL payload
+static uint8_t scroll_msg[2];
+
+// Payload of a message in RX_BLOCK state
+static uint8_t *block_buf;
+static unsigned block_fill = 0;
+
+// Window of the current transfer {x1, y1, x2, y2} in [pixels], inclusive
+static uint8_t win[4];
+static unsigned win_fill = 0;
+
+// PackBits decoder for MSG_WINDOW_RLE
+static bool rx_rle = false;  // the pixels of the current window are compressed
+static uint8_t rle_in[64];   // compressed data read from USB
+static unsigned rle_rd = 0, rle_wr = 0;
+static enum {
+    RLE_CTRL,     // next byte is a control byte
+    RLE_LITERAL,  // copy rle_n bytes
+    RLE_VALUE,    // next byte is the value to repeat
+    RLE_REPEAT,   // repeat rle_val rle_n times
+} rle_state = RLE_CTRL;
+static unsigned rle_n = 0;
+static uint8_t rle_val = 0;
+
+// Ping-pong staging buffers
+static uint8_t stage[2][STAGE_SIZE];
+static unsigned stage_cur = 0;     // index of the buffer being filled from USB
+static unsigned stage_fill = 0;    // number of valid bytes in it
+static bool stage_prefix = false;  // it holds the start of a new frame
+
+// The staging buffers can't be touched right now
+static bool stage_busy(void) {
+    // the framebuffer is written synchronously
+    return fb_mode != FB_MODE_BUFFERED && ssd1322_busy();
+}
+
+// Hand the buffer being filled over to DMA and continue with the other one
+static void stage_submit(void) {
+    if (fb_mode == FB_MODE_BUFFERED)
+        fb_write(stage_fill, stage[stage_cur]);
+    else
+        send_fb(stage_prefix, stage_fill, stage[stage_cur]);
+    stage_cur ^= 1;
+    stage_fill = 0;
+    stage_prefix = false;
+}
+
+static uint32_t rx_total = 0;  // bytes read from USB, wraps around
+
+// Read up to n bytes from USB, returns the number of bytes read
+static uint32_t rx_read(void *buf, uint32_t n) {
+    n = tud_vendor_read(buf, n);
+    rx_total += n;
+    stat_count(CNT_RX_BYTES, n);
+    return n;
+}
+
+// Read and drop up to n bytes from USB, returns the number of bytes dropped
+static unsigned rx_discard(unsigned n) {
+    uint8_t dummy[64];
+    return rx_read(dummy, MIN(n, sizeof(dummy)));
+}
+
+// Whatever is in the FIFO now belongs to an aborted transfer
+static void rx_discard_fifo(void) {
+    while (tud_vendor_available())
+        rx_discard(64);
+}
+
+// Forget about the current transfer and wait for the start of a new one
+static void rx_reset(void) {
+    stage_fill = 0;
+    byte_index = 0;
+    frame_size = 0;
+    hdr_fill = 0;
+    rx_rle = false;
+    rx_state = (fb_mode != FB_MODE_RAW) ? RX_HEADER : RX_SYNC;
+    if (depth_new != 0)
+        depth_apply();
+}
+
+// CMD_RESET, runs beside the USB handling. The bulk data waits meanwhile.
+static bool reset_work(void) {
+    if (!ui_init_step())
+        return false;
+    // The init sequence reset the window and ended the write to the display RAM, the rest of a
+    // window would go to the wrong place. Wait for the next frame or message.
+    rx_reset();
+    // the display content is lost
+    if (fb_mode == FB_MODE_BUFFERED)
+        fb_invalidate();
+    // and the init sequence loaded the default gamma table, a custom one is kept
+    if (gamma_custom)
+        gamma_request = true;
+    return true;
+}
+
+static void window_full(void) {
+    win[0] = 0;
+    win[1] = 0;
+    win[2] = DISPLAY_WIDTH - 1;
+    win[3] = DISPLAY_HEIGHT - 1;
+}
+
+// Number of pixel bytes of the window in win[], 0 if it is invalid
+static unsigned window_size(void) {
+    unsigned x1 = win[0], y1 = win[1], x2 = win[2], y2 = win[3];
+    // Without framebuffer, all of the display RAM can be written, for hardware scrolling
+    const unsigned rows = (fb_mode == FB_MODE_BUFFERED) ? DISPLAY_HEIGHT : GDDRAM_ROWS;
+    if (x1 > x2 || y1 > y2 || y2 >= rows)
+        return 0;
+    // 4 pixels = 2 bytes per column
+    return ((x2 >> 2) - (x1 >> 2) + 1) * 2 * (y2 - y1 + 1);
+}
+
+// Decide what to do with the message in hdr
+static void msg_start(void) {
+    msg_left = hdr.len;
+    if (hdr.type == MSG_FRAME && hdr.len == packed_size(FRAME_SIZE)) {
+        window_full();
+        frame_size = FRAME_SIZE;
+        msg_left = 0;
+        rx_rle = false;
+        rx_state = RX_SETUP;
+    } else if ((hdr.type == MSG_WINDOW || hdr.type == MSG_WINDOW_RLE) &&
+               hdr.len >= sizeof(win)) {
+        rx_rle = hdr.type == MSG_WINDOW_RLE;
+        win_fill = 0;
+        msg_left -= sizeof(win);
+        rx_state = RX_WINDOW;
+    } else if (hdr.type == MSG_DRAW && fb_mode == FB_MODE_BUFFERED && hdr.len <= DRAW_BUF_SIZE) {
+        block_buf = draw_buf;
+        block_fill = 0;
+        rx_state = RX_BLOCK;
+    } else if (hdr.type == MSG_SCROLL && fb_mode == FB_MODE_PACKET &&
+               hdr.len == sizeof(scroll_msg)) {
+        block_buf = scroll_msg;
+        block_fill = 0;
+        rx_state = RX_BLOCK;
+    } else if (hdr.type == MSG_FONT && hdr.len <= FONT_MEM_SIZE) {
+        block_buf = font_buffer();
+        block_fill = 0;
+        rx_state = RX_BLOCK;
+    } else {
+        // Unknown or malformed message
+        rx_state = RX_SKIP;
+    }
+}
+
+// Decompress PackBits data from USB into the staging buffer, up to the end of the window.
+// Control byte n: 0 - 127: copy the next n + 1 bytes, 129 - 255: repeat the next byte
+// 257 - n times, 128: no-op.
+static void rx_unpack(void) {
+    uint8_t *out = &stage[stage_cur][stage_fill];
+    const unsigned space = MIN(STAGE_SIZE - stage_fill, frame_size - byte_index);
+    unsigned n = 0;
+
+    while (n < space) {
+        if (rle_state == RLE_REPEAT) {
+            unsigned run = MIN(rle_n, space - n);
+            memset(&out[n], rle_val, run);
+            n += run;
+            rle_n -= run;
+            if (rle_n == 0)
+                rle_state = RLE_CTRL;
+            continue;
+        }
+
+        // All other states need input
+        if (rle_rd >= rle_wr) {
+            rle_rd = 0;
+            rle_wr = rx_read(rle_in, MIN(msg_left, sizeof(rle_in)));
+            msg_left -= rle_wr;
+            if (rle_wr == 0)
+                break;
+        }
+        const uint8_t b = rle_in[rle_rd++];
+
+        switch (rle_state) {
+        case RLE_CTRL:
+            if (b < 128) {
+                rle_n = b + 1;
+                rle_state = RLE_LITERAL;
+            } else if (b > 128) {
+                rle_n = 257 - b;
+                rle_state = RLE_VALUE;
+            }
+            break;
+
+        case RLE_LITERAL:
+            out[n++] = b;
+            if (--rle_n == 0)
+                rle_state = RLE_CTRL;
+            break;
+
+        case RLE_VALUE:
+            rle_val = b;
+            rle_state = RLE_REPEAT;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    stage_fill += n;
+    byte_index += n;
+}
+
+// Read pixels of less than 4 bits from USB and expand them into the staging buffer, up to the end
+// of the window. The pixels of a window are packed without padding between the rows.
+static void rx_expand(void) {
+    uint8_t *out = &stage[stage_cur][stage_fill];
+    const unsigned space = MIN(STAGE_SIZE - stage_fill, frame_size - byte_index);
+    const unsigned ratio = 4 / depth;  // display bytes per input byte
+    uint8_t in[64];
+
+    // Only the last byte of a window may not fit completely
+    const unsigned n = rx_read(in, MIN((space + ratio - 1) / ratio, sizeof(in)));
+    unsigned len = 0;
+    for (unsigned i = 0; i < n; i++) {
+        uint8_t px[4];
+        if (depth == 1) {
+            memcpy(px, depth_lut[in[i] >> 4], 2);
+            memcpy(px + 2, depth_lut[in[i] & 0xF], 2);
+        } else {
+            memcpy(px, depth_lut[in[i]], 2);
+        }
+        for (unsigned k = 0; k < ratio && len < space; k++)
+            out[len++] = px[k];
+    }
+
+    stage_fill += len;
+    byte_index += len;
+}
+
+// The message in hdr has been processed. It completes a frame right away, unless pixels are
+// still on their way to the display, which then complete it with this seq.
+static void msg_done(void) {
+    msg_seq = hdr.seq;
+    const bool pixels_pending =
+        fb_mode == FB_MODE_BUFFERED ? fb_busy() : frame_pending || stage_fill > 0;
+    if (!pixels_pending)
+        frame_complete();
+}
+
+// Read (part of) a message header and resynchronize on the magic byte if needed
+static void rx_header(void) {
+    uint8_t *p = (uint8_t *)&hdr;
+    hdr_fill += rx_read(&p[hdr_fill], sizeof(hdr) - hdr_fill);
+
+    // Out of sync, drop bytes until we find something which looks like a header
+    while (hdr_fill > 0 && p[0] != MSG_MAGIC) {
+        memmove(p, p + 1, --hdr_fill);
+    }
+
+    if (hdr_fill >= sizeof(hdr)) {
+        hdr_fill = 0;
+        msg_start();
+    }
+}
+
+// ---------------------------------
+//  Interrupt endpoint for input reports
+// ---------------------------------
+static volatile bool report_busy = false;  // waiting for the host to pick up a report
+static unsigned report_flags = 0;          // button flags of the last report
+
+// Fill in the presentation status of a report
+static void frame_status(input_packet_t *packet) {
+    packet->frame_flags = frame_done ? FRAME_DONE : 0;
+    packet->clock_reg = ssd1322_clock_reg();
+    packet->frame_seq = frame_seq;
+    packet->frame_t_us = frame_t_us;
+    packet->refresh_us = ssd1322_refresh_us();
+    frame_done = false;
+}
+
+// Send a report when an input changed and the host has picked up the previous one
+static void report_task(void) {
+    if (report_busy)
+        return;
+
+    const unsigned flags = get_button_flags();
+    const int ticks = get_encoder_ticks(false);
+    const int accel = peek_encoder_accel();
+    const bool frame = frame_done && (vsync_flags & VSYNC_REPORT);
+    // the upper bits are press events, they always need to be reported
+    if (ticks == 0 && accel == 0 && flags == report_flags && (flags & ~0x3) == 0 && !frame)
         return;
 
+    input_packet_t packet = {0};
+    packet.button_flags = flags;
+    packet.encoder_delta = take_encoder_ticks(INT8_MAX);
+    packet.encoder_accel = take_encoder_accel(INT8_MAX);
+    frame_status(&packet);
+    report_busy = true;
+    tud_vendor_write(&packet, sizeof(packet));
+    tud_vendor_write_flush();
+    report_flags = flags;
+}
+
+// Invoked when the host picked up an input report
+void tud_vendor_tx_cb(uint8_t itf, uint32_t sent_bytes) {
+    (void)itf;
+    (void)sent_bytes;
+    report_busy = false;
+}
+
+// Invoked when the device is (re-)configured by the host
+void tud_mount_cb(void) {
+    report_busy = false;
+    // an interrupted CMD_BATCH
+    batch_rx = false;
+    batch_len = 0;
+}
+
+// A report would be sent by report_task()
+static bool report_pending(void) {
+    if (report_busy)
+        return false;
+    const unsigned flags = peek_button_flags();
+    return get_encoder_ticks(false) != 0 || peek_encoder_accel() != 0 || flags != report_flags ||
+           (flags & ~0x3) != 0 || (frame_done && (vsync_flags & VSYNC_REPORT));
+}
+
+bool vendor_pending(void) {
+    if (!tud_vendor_mounted())
+        return false;
+    if (report_pending())
+        return true;
+    if (work_pending(reset_work))
+        return false;
+    // Waiting for USB data or for a DMA transfer to finish needs nothing to be done,
+    // their interrupts wake up the scheduler.
+    return tud_vendor_available() || flush_request || stage_fill > 0 || frame_pending ||
+           ((rx_state == RX_SETUP || rx_state == RX_SCROLL) && !stage_busy()) ||
+           (rx_state == RX_SKIP && msg_left == 0) ||
+           (rx_state == RX_BLOCK && block_fill >= msg_left) ||
+           (rx_state == RX_PIXELS && (rx_rle || byte_index >= frame_size)) || scroll_request ||
+           gamma_request || (batch_len > 0 && !batch_rx) ||
+           (fb_mode == FB_MODE_BUFFERED && fb_pending());
+}
+
+// One pass over the bulk data: read what the current state needs, hand full staging buffers to
+// the display and apply what waits for the end of a window
+static void bulk_step(void) {
     // -----------------------------------------------------------
     //  Bulk endpoint to receive framebuffer data from the PC
     // -----------------------------------------------------------
     // Check if there is data available in the USB buffer
     if (tud_vendor_available()) {
-        unsigned now = millis();
+        const uint32_t now = micros();
 
         // ---------------------------------
         //  Synchronization Logic
         // ---------------------------------
-        // If the bus has been silent for > 4ms, assume this is a NEW frame.
-        if ((now - last_packet_time) > SYNC_TIMEOUT_MS) {
-            byte_index = 0;  // Reset pointer to start of framebuffer
+        // In raw mode, if the bus has been silent for > 4ms, assume this is a NEW frame.
+        // In packet mode, the message headers take care of this.
+        if (fb_mode == FB_MODE_RAW &&
+            (rx_state == RX_SYNC || (now - last_packet_time) > SYNC_TIMEOUT_US)) {
+            if (rx_state != RX_SYNC) {
+                stat_count(CNT_SYNC_RESETS, 1);
+                if (byte_index < frame_size)
+                    stat_count(CNT_DROPPED, 1);
+            }
+            stage_fill = 0;  // Drop left-overs of an incomplete frame
+            window_full();
+            frame_size = FRAME_SIZE;
+            rx_rle = false;
+            rx_state = RX_SETUP;
         }
         // Update timestamp
         last_packet_time = now;
@@ -49,44 +664,208 @@ void vendor_task(void) {
         // ---------------------------------
         //  Read from USB
         // ---------------------------------
-        // Read whatever is available (up to packet size)
-        uint8_t buffer[64];
-        unsigned count = tud_vendor_read(buffer, sizeof(buffer));
-        if (count <= 0)
-            return;
+        switch (rx_state) {
+        case RX_HEADER:
+            rx_header();
+            break;
 
-        // ---------------------------------
-        //  Write to display buffer
-        // ---------------------------------
-        // Only write if we haven't overflown the frame
-
-        if (byte_index < FRAME_SIZE) {
-            // Calculate how much we can actually write
-            unsigned remaining = FRAME_SIZE - byte_index;
-            if (count > remaining)
-                count = remaining;
-            send_fb(byte_index == 0, count, buffer);
-            byte_index += count;
+        case RX_WINDOW:
+            win_fill += rx_read(&win[win_fill], sizeof(win) - win_fill);
+            if (win_fill >= sizeof(win)) {
+                frame_size = window_size();
+                if (rx_rle && frame_size > 0) {
+                    // msg_left is the size of the compressed data
+                    rle_rd = rle_wr = 0;
+                    rle_state = RLE_CTRL;
+                    rx_state = RX_SETUP;
+                } else if (frame_size > 0 && packed_size(frame_size) == msg_left) {
+                    msg_left = 0;
+                    rx_state = RX_SETUP;
+                } else {
+                    rx_state = RX_SKIP;
+                }
+            }
+            break;
+
+        case RX_PIXELS:
+            // Compressed pixels are decoded below
+            if (rx_rle)
+                break;
+            if (byte_index < frame_size && depth < 4) {
+                rx_expand();
+            } else if (byte_index < frame_size) {
+                // Read as much as fits into the staging buffer, but not beyond the end of the
+                // frame. If both buffers are busy, this reads nothing and the data stays in the
+                // USB FIFO.
+                unsigned count = MIN(STAGE_SIZE - stage_fill, frame_size - byte_index);
+                count = rx_read(&stage[stage_cur][stage_fill], count);
+                stage_fill += count;
+                byte_index += count;
+            } else {
+                // Frame overflow, discard the data
+                if (!rx_overflow)
+                    stat_count(CNT_OVERFLOWS, 1);
+                rx_overflow = true;
+                rx_discard(64);
+            }
+            break;
+
+        case RX_SKIP:
+            msg_left -= rx_discard(msg_left);
+            break;
+
+        case RX_BLOCK:
+            block_fill += rx_read(&block_buf[block_fill], msg_left - block_fill);
+            break;
+
+        default:
+            break;
         }
 
-        // Note that once the frame is written completely, we implicitly require a
-        // a quiet period > SYNC_TIMEOUT_MS before we are ready to accept the next
-        // frame and before the byte_index is reset.
+        // Note that in raw mode, once the frame is written completely, we implicitly
+        // require a quiet period > SYNC_TIMEOUT_US before we are ready to accept the
+        // next frame and before the byte_index is reset.
+    }
+
+    // The end of a message, also of one with nothing (left) to read, which must not wait for
+    // more data to arrive
+    if (rx_state == RX_SKIP && msg_left == 0) {
+        rx_state = RX_HEADER;
+        // the rest of a compressed window has the seq already
+        if (msg_seq != hdr.seq)
+            msg_done();
+    }
+    if (rx_state == RX_BLOCK && block_fill >= msg_left) {
+        rx_state = RX_HEADER;
+        if (hdr.type == MSG_DRAW) {
+            fb_draw(block_buf, block_fill);
+            msg_done();
+        } else if (hdr.type == MSG_SCROLL) {
+            rx_state = RX_SCROLL;
+        } else {
+            font_load(block_fill);
+            msg_done();
+        }
+    }
+
+    // Compressed data may expand into more pixels than fit in the staging buffer,
+    // so keep decoding even when USB has nothing new for us
+    if (rx_state == RX_PIXELS && rx_rle)
+        rx_unpack();
+
+    // In packet mode the next message may follow right away
+    if (fb_mode != FB_MODE_RAW && rx_state == RX_PIXELS) {
+        if (rx_rle) {
+            // Done when the window is complete or the compressed data ran out.
+            // Skip whatever is left of the message.
+            bool in_empty = msg_left == 0 && rle_rd >= rle_wr && rle_state != RLE_REPEAT;
+            if (byte_index >= frame_size || in_empty) {
+                rx_rle = false;
+                rx_state = RX_SKIP;
+            }
+        } else if (byte_index >= frame_size) {
+            rx_state = RX_HEADER;
+        }
+    }
+
+    // ---------------------------------
+    //  Write to display
+    // ---------------------------------
+    // Once the other buffer has been sent, submit the one being filled if it is full,
+    // completes the frame or if USB has nothing more for us right now.
+    if (stage_fill > 0 && !stage_busy()) {
+        if (stage_fill >= STAGE_SIZE || rx_state != RX_PIXELS || byte_index >= frame_size ||
+            !tud_vendor_available()) {
+            // the last pixels of the window, fb_task() completes the frame in buffered mode
+            if (byte_index >= frame_size && fb_mode != FB_MODE_BUFFERED)
+                frame_pending = true;
+            stage_submit();
+        }
+    }
+
+    // Once they are out, the frame is complete. The framebuffer has its own idea of that.
+    if (frame_pending && fb_mode != FB_MODE_BUFFERED && stage_fill == 0 && !ssd1322_busy()) {
+        frame_pending = false;
+        frame_complete();
+    }
+
+    // A new window can only be set up once all pixels of the previous one are out
+    if (rx_state == RX_SETUP && stage_fill == 0 && !stage_busy()) {
+        if (fb_mode == FB_MODE_BUFFERED)
+            fb_window(win[0], win[1], win[2], win[3]);
+        else
+            set_window(win[0], win[1], win[2], win[3]);
+        byte_index = 0;
+        stage_prefix = true;
+        rx_overflow = false;
+        rx_state = RX_PIXELS;
+        msg_seq = (fb_mode == FB_MODE_RAW) ? msg_seq + 1 : hdr.seq;
+    }
+
+    // A command in the middle of the pixel data would end the write to the display RAM,
+    // so hardware scrolling waits for the current window to complete
+    bool window_done = rx_state != RX_SETUP && (rx_state != RX_PIXELS || byte_index >= frame_size);
+    if (scroll_request && window_done && stage_fill == 0 && !ssd1322_busy()) {
+        scroll_request = false;
+        set_start_line(scroll_start, scroll_offset);
+    }
+
+    // The messages after a MSG_SCROLL wait for it, it is ordered with the pixel data
+    if (rx_state == RX_SCROLL && stage_fill == 0 && !ssd1322_busy()) {
+        set_start_line(scroll_msg[0], scroll_msg[1]);
+        msg_seq = hdr.seq;
+        frame_complete();
+        rx_state = RX_HEADER;
+    }
+
+    if (gamma_request && window_done && stage_fill == 0 && !ssd1322_busy()) {
+        gamma_request = false;
+        set_gamma(gamma_custom ? gamma_table : NULL);
+    }
+
+    // Same for the batched commands, which may write to the display
+    if (batch_len > 0 && !batch_rx && window_done && stage_fill == 0 && !ssd1322_busy()) {
+        batch_run(batch_buf, batch_len, true);
+        batch_len = 0;
     }
 }
 
-// Command IDs
-enum {
-    CMD_RESET = 0x10,
-    CMD_VERSION = 0x11,
-    CMD_BTNS_ENC = 0x20,
-    CMD_IO_LEDS = 0x21,
-    // CMD_IO_AUX_OE = 0x28,
-    // CMD_IO_AUX_OL = 0x29,
-    // CMD_OLED_FLUSH = 0x30,
-    CMD_OLED_BRIGHTNESS = 0x31,
-    CMD_OLED_INVERTED = 0x32,
-};
+void vendor_task(void) {
+    if (!tud_vendor_mounted())
+        return;
+
+    report_task();
+
+    // The display is being initialized
+    if (work_pending(reset_work))
+        return;
+
+    if (flush_request) {
+        flush_request = false;
+        rx_reset();
+    }
+
+    // Drain the FIFO in one call, instead of one pass per USB packet. Stop when nothing moves any
+    // more, e.g. both staging buffers are busy, and after a FIFO worth of data, so the other tasks
+    // get their turn while the host keeps streaming.
+    if (tud_vendor_available() >= CFG_TUD_VENDOR_RX_BUFSIZE)
+        stat_count(CNT_RX_FULL, 1);
+    const uint32_t rx_start = rx_total;
+    for (;;) {
+        const uint32_t prev = rx_total;
+        const unsigned state = rx_state;
+        bulk_step();
+        if ((rx_total == prev && rx_state == state) || !tud_vendor_available() ||
+            rx_total - rx_start >= CFG_TUD_VENDOR_RX_BUFSIZE)
+            break;
+    }
+    if (rx_total != rx_start)
+        stat_count(CNT_RX_PASSES, 1);
+
+    // Send the changes to the display. Only in this mode, the display is ours otherwise.
+    if (fb_mode == FB_MODE_BUFFERED && fb_task())
+        frame_complete();
+}
 
 #ifndef GIT_REV
 #define GIT_REV "?"
@@ -102,12 +881,18 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport,
                                 uint8_t stage,
                                 tusb_control_request_t const *request) {
     input_packet_t packet = {0};
+    unsigned n;
 
     // 1. SETUP STAGE (Host sends the command)
     if (stage == CONTROL_STAGE_SETUP) {
+        // A SETUP ends the previous control transfer, so does a CMD_BATCH whose data never came
+        batch_rx = false;
+
         switch (request->bRequest) {
         case CMD_RESET:
-            ui_init();
+            // It takes a few ms, don't let the host wait for it
+            if (!work_post(reset_work))
+                return false;
             // ACK the transfer (no data stage needed)
             return tud_control_status(rhport, request);
 
@@ -115,28 +900,144 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport,
             // Reply with data
             return tud_control_xfer(rhport, request, (void *)fw_version, strlen(fw_version));
 
+        case CMD_STATS:
+            // wValue = 1: start a new measurement period
+            stats_read(&stats, request->wValue & 1);
+            return tud_control_xfer(rhport, request, (void *)&stats, sizeof(stats));
+
+        case CMD_SPI_CLOCK:
+            if (request->wValue > 7 || request->wIndex > 7)
+                return false;
+            // The self-test would wait for a display transfer, up to ~100 ms at the slowest clock.
+            // Interrupt handlers hold the bus only during their call, so once free, it stays free.
+            if (spi_bus_owner() != SPI_DEV_NONE)
+                return false;
+            spi_bus_set_clock(SPI_DEV_OLED, request->wValue);
+            spi_bus_set_clock(SPI_DEV_MCP, request->wIndex);
+            selftest.n_tests = SELFTEST_N;
+            selftest.n_failed = mcp23_selftest();
+            // Don't lose the inputs, go back to the safe default
+            if (selftest.n_failed > 0)
+                spi_bus_set_clock(SPI_DEV_MCP, SPI_BR_DEFAULT);
+            return tud_control_xfer(rhport, request, (void *)&selftest, sizeof(selftest));
+
+        case CMD_BATCH:
+            // appended to what is still pending, they are validated once received
+            if (request->wLength > BATCH_SIZE - batch_len)
+                return false;
+            if (request->wLength == 0)
+                return tud_control_status(rhport, request);
+            batch_rx = true;
+            return tud_control_xfer(rhport, request, batch_buf + batch_len, request->wLength);
+
         case CMD_IO_LEDS:
-            set_leds(request->wValue);
+        case CMD_ENC_ACCEL:
+        case CMD_OLED_BRIGHTNESS:
+        case CMD_OLED_INVERTED:
+        case CMD_OLED_FB_RATE:
+        case CMD_OLED_VSYNC:
+            // applied by vendor_task() between windows, in order with the batched ones
+            if (!batch_push(request->bRequest, request->wValue, request->wIndex))
+                return false;
             return tud_control_status(rhport, request);
 
         case CMD_BTNS_ENC:
             packet.button_flags = get_button_flags();
-            packet.encoder_delta = get_encoder_ticks(true);
+            packet.encoder_delta = take_encoder_ticks(INT8_MAX);
+            packet.encoder_accel = take_encoder_accel(INT8_MAX);
             return tud_control_xfer(rhport, request, (void *)&packet, sizeof(packet));
 
-        case CMD_OLED_BRIGHTNESS:
-            set_brightness(MIN(request->wValue, 16));
+        case CMD_EVENTS:
+            // Only take as many events from the queue as the host asked for
+            n = (request->wLength - MIN(request->wLength, 4)) / sizeof(ui_event_t);
+            events.n = get_events(events.ev, MIN(n, MAX_EVENTS));
+            events.lost = get_events_lost();
+            n = sizeof(events) - sizeof(events.ev) + events.n * sizeof(ui_event_t);
+            return tud_control_xfer(rhport, request, (void *)&events, n);
+
+        case CMD_OLED_FLUSH:
+            rx_discard_fifo();
+            flush_request = true;
             return tud_control_status(rhport, request);
 
-        case CMD_OLED_INVERTED:
-            set_inverted(request->wValue);
+        case CMD_OLED_MODE:
+            if (request->wValue > FB_MODE_BUFFERED)
+                return false;
+            // start from a known display content
+            if (request->wValue == FB_MODE_BUFFERED && fb_mode != FB_MODE_BUFFERED)
+                fb_clear();
+            fb_mode = request->wValue;
+            // the new mode completes its own frames
+            frame_pending = false;
+            flush_request = true;
+            return tud_control_status(rhport, request);
+
+        case CMD_OLED_SCROLL:
+            // The framebuffer only knows the visible rows
+            if (fb_mode == FB_MODE_BUFFERED)
+                return false;
+            scroll_start = request->wValue;
+            scroll_offset = request->wIndex;
+            scroll_request = true;
             return tud_control_status(rhport, request);
 
+        case CMD_OLED_DEPTH:
+            // wValue: bits / pixel, optional data stage: the shade of each pixel value
+            n = request->wValue;
+            if (n != 1 && n != 2 && n != 4)
+                return false;
+            if (request->wLength != 0 && (n == 4 || request->wLength != 1u << n))
+                return false;
+            if (request->wLength > 0)
+                return tud_control_xfer(rhport, request, palette_rx, request->wLength);
+            depth_request(n, NULL);
+            rx_discard_fifo();
+            flush_request = true;
+            return tud_control_status(rhport, request);
+
+        case CMD_OLED_GAMMA:
+            // no data stage: back to the default table
+            if (request->wLength == 0) {
+                gamma_custom = false;
+                gamma_request = true;
+                return tud_control_status(rhport, request);
+            }
+            if (request->wLength != GAMMA_LEVELS)
+                return false;
+            return tud_control_xfer(rhport, request, gamma_rx, GAMMA_LEVELS);
+
         default:
             // Unknown RPC -> STALL (Python will raise USBError)
             return false;
         }
     }
 
+    // 2. DATA STAGE (Host data of an OUT request has been received)
+    if (stage == CONTROL_STAGE_DATA && request->bRequest == CMD_BATCH) {
+        batch_rx = false;
+        if (!batch_run(batch_buf + batch_len, request->wLength, false))
+            return false;
+        batch_len += request->wLength;
+    }
+
+    if (stage == CONTROL_STAGE_DATA && request->bRequest == CMD_OLED_DEPTH) {
+        for (unsigned i = 0; i < request->wLength; i++)
+            if (palette_rx[i] > 15)
+                return false;
+        depth_request(request->wValue, palette_rx);
+        rx_discard_fifo();
+        flush_request = true;
+    }
+
+    if (stage == CONTROL_STAGE_DATA && request->bRequest == CMD_OLED_GAMMA) {
+        // the controller needs GS1 <= GS2 <= ... <= GS15 <= 180
+        for (unsigned i = 0; i < GAMMA_LEVELS; i++)
+            if (gamma_rx[i] > 180 || (i > 0 && gamma_rx[i] < gamma_rx[i - 1]))
+                return false;
+        memcpy(gamma_table, gamma_rx, GAMMA_LEVELS);
+        gamma_custom = true;
+        gamma_request = true;
+    }
+
     return true;
 }
@@ -1,4 +1,9 @@
 #pragma once
 
+#include <stdbool.h>
+
 // Poll this in the main-loop
 void vendor_task(void);
+
+// true if vendor_task() has something to do
+bool vendor_pending(void);
@@ -0,0 +1,36 @@
+#include "work.h"
+#include <stddef.h>
+
+// Ring buffer of queued work, the oldest being worked on
+static work_fn_t queue[WORK_N];
+static unsigned rd = 0, n_queued = 0;
+
+bool work_pending(work_fn_t fn) {
+    for (unsigned i = 0; i < n_queued; i++)
+        if (queue[(rd + i) % WORK_N] == fn)
+            return true;
+    return false;
+}
+
+bool work_queued(void) { return n_queued > 0; }
+
+bool work_post(work_fn_t fn) {
+    if (work_pending(fn))
+        return true;
+    if (n_queued >= WORK_N)
+        return false;
+    queue[(rd + n_queued) % WORK_N] = fn;
+    n_queued++;
+    return true;
+}
+
+void work_task(void) {
+    if (n_queued == 0)
+        return;
+    // one at a time, so they don't get in each other's way on the bus
+    if (!queue[rd]())
+        return;
+    queue[rd] = NULL;
+    rd = (rd + 1) % WORK_N;
+    n_queued--;
+}
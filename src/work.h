@@ -0,0 +1,23 @@
+#pragma once
+#include <stdbool.h>
+
+// Deferred work: slow operations which would stall the USB handling when run from its
+// callbacks. A work function is a resumable state machine, doing one short step per call.
+// It's called from the main loop again and again until it returns true.
+typedef bool (*work_fn_t)(void);
+
+// Number of work items which can be queued
+#define WORK_N 8
+
+// Queue fn to run from work_task(), after the ones queued before. Does nothing if fn is
+// queued already. Returns false if the queue is full. Don't call this from an interrupt handler.
+bool work_post(work_fn_t fn);
+
+// true while fn is queued (or running)
+bool work_pending(work_fn_t fn);
+
+// true if anything is queued
+bool work_queued(void);
+
+// Call in main loop: runs one step of the oldest work item
+void work_task(void);